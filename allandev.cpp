@@ -0,0 +1,129 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include "allanvariance.h"
+#include "noiseparameters.h"
+
+using namespace std;
+
+void printUsage()
+{
+	cout << "Usage: allandev [-o <noise file>] [--per-decade <n>] [--curves] <static logfile.csv> ..." << endl;
+	cout << "Computes the Allan deviation of every axis of static delta quantities recordings and stores the" << endl;
+	cout << "resulting filter noise settings per device in the noise file (default noise_parameters.csv)," << endl;
+	cout << "keeping the entries of other devices. --curves also writes <logfile>.allan.csv next to each logfile." << endl;
+}
+
+bool writeCurves(const AllanAnalysis& analysis)
+{
+	ofstream file(analysis.fileName + ".allan.csv");
+	if (!file)
+		return false;
+
+	file << "Tau,GyrX,GyrY,GyrZ,AccX,AccY,AccZ\n" << scientific << setprecision(6);
+	for (size_t p = 0; p < analysis.curves[0].tau.size(); ++p)
+	{
+		file << analysis.curves[0].tau[p];
+		for (int a = 0; a < AllanAnalysis::Axes; ++a)
+			file << "," << analysis.curves[a].deviation[p];
+		file << "\n";
+	}
+	return static_cast<bool>(file.flush());
+}
+
+void printAnalysis(const AllanAnalysis& analysis)
+{
+	static const char* const axisNames[AllanAnalysis::Axes] = { "GyrX", "GyrY", "GyrZ", "AccX", "AccY", "AccZ" };
+
+	cout << analysis.bluetoothAddress << "  " << analysis.fileName << "  " << analysis.sampleCount << " samples, "
+		<< fixed << setprecision(1) << analysis.sampleCount * analysis.sampleInterval << " s" << endl;
+	cout << "        " << setw(12) << "mean" << setw(12) << "white" << setw(12) << "bias inst" << setw(10) << "@ tau"
+		<< setw(12) << "rate rw" << endl;
+	for (int a = 0; a < AllanAnalysis::Axes; ++a)
+	{
+		const NoiseTerms& terms = analysis.terms[a];
+		cout << "  " << axisNames[a] << "  " << scientific << setprecision(3)
+			<< setw(12) << analysis.mean[a] << setw(12) << terms.randomWalk << setw(12) << terms.biasInstability
+			<< fixed << setprecision(1) << setw(9) << terms.biasInstabilityTau << "s"
+			<< scientific << setprecision(3) << setw(12) << terms.rateRandomWalk << endl;
+	}
+	cout << "  gyroscope: mean in rad/s, white in rad/s/sqrt(Hz), bias instability in rad/s, rate random walk in rad/s^2/sqrt(Hz)" << endl;
+	cout << "  accelerometer: the same in m/s^2 instead of rad/s, the mean includes gravity" << endl;
+}
+
+//--------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	string noiseFileName = "noise_parameters.csv";
+	size_t perDecade = 10;
+	bool curves = false;
+	vector<string> fileNames;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc)
+			noiseFileName = argv[++i];
+		else if (arg == "--per-decade" && i + 1 < argc)
+			perDecade = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--curves")
+			curves = true;
+		else if (arg == "-h" || arg == "--help")
+		{
+			printUsage();
+			return 0;
+		}
+		else
+			fileNames.push_back(arg);
+	}
+	if (fileNames.empty() || perDecade == 0)
+	{
+		printUsage();
+		return -1;
+	}
+
+	auto start = chrono::steady_clock::now();
+	vector<AllanAnalysis> results;
+	size_t analyzed = analyzeLogFiles(fileNames, results, perDecade);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	map<string, FilterNoise> noise;
+	loadNoiseParameters(noiseFileName, noise);
+	for (auto const& analysis : results)
+	{
+		cout << string(83, '-') << endl;
+		if (analysis.sampleCount == 0)
+		{
+			cout << "Could not analyze " << analysis.fileName << endl;
+			continue;
+		}
+
+		printAnalysis(analysis);
+		if (curves && !writeCurves(analysis))
+			cout << "  could not write the Allan deviation curves" << endl;
+		if (analysis.bluetoothAddress.empty())
+		{
+			cout << "  no bluetooth address in the file name, the noise settings are not stored" << endl;
+			--analyzed;
+			continue;
+		}
+		if (noise.count(analysis.bluetoothAddress))
+			cout << "  replaces the earlier noise settings of " << analysis.bluetoothAddress << endl;
+		noise[analysis.bluetoothAddress] = analysis.filterNoise();
+	}
+	cout << string(83, '-') << endl;
+	cout << "Analyzed " << analyzed << " of " << fileNames.size() << " file(s) in " << fixed << setprecision(2) << seconds << " s" << endl;
+
+	if (analyzed && !saveNoiseParameters(noiseFileName, noise))
+	{
+		cout << "Could not write " << noiseFileName << endl;
+		return -1;
+	}
+	if (analyzed)
+		cout << "Noise settings of " << noise.size() << " device(s) stored in " << noiseFileName << endl;
+	return analyzed == fileNames.size() ? 0 : -1;
+}
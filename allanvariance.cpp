@@ -0,0 +1,277 @@
+#include "allanvariance.h"
+
+#include "csvlog.h"
+#include "parallelfor.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+//! Ratio between the flat minimum of an Allan deviation curve and the bias instability
+const double BIAS_INSTABILITY_FACTOR = 0.664;
+
+//! Maximum distance of a local log-log slope from -1/2 or +1/2 to count as that noise term
+const double SLOPE_TOLERANCE = 0.2;
+
+//! Mean of a set of values, ignoring the ones that are 0, or 0 if all of them are
+double meanOfNonZero(const double* values, int count)
+{
+	double sum = 0.0;
+	int n = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (values[i] > 0.0)
+		{
+			sum += values[i];
+			++n;
+		}
+	}
+	return n ? sum / n : 0.0;
+}
+
+/*! \brief Read a logfile and integrate the mean-free increments of its six axes
+	\details Removing the mean first keeps the cumulative sums small, so they do not lose precision
+	on long recordings. A constant offset does not change the Allan variance.
+*/
+bool integrateLogFile(const string& fileName, AllanAnalysis& analysis, array<vector<double>, AllanAnalysis::Axes>& integral)
+{
+	LogFile log;
+	if (!readLogFile(fileName, log) || log.outputRate <= 0.0 || log.samples.size() < 4)
+		return false;
+
+	size_t count = log.samples.size();
+	vector<double> increments[AllanAnalysis::Axes];
+	for (auto& axis : increments)
+		axis.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		Vec3 dTheta = quatToRotationVector(log.samples[i].dq);
+		const Vec3& dv = log.samples[i].dv;
+		increments[0][i] = dTheta.x;
+		increments[1][i] = dTheta.y;
+		increments[2][i] = dTheta.z;
+		increments[3][i] = dv.x;
+		increments[4][i] = dv.y;
+		increments[5][i] = dv.z;
+	}
+
+	analysis.fileName = fileName;
+	analysis.bluetoothAddress = log.bluetoothAddress;
+	analysis.sampleCount = count;
+	analysis.sampleInterval = 1.0 / log.outputRate;
+	for (int a = 0; a < AllanAnalysis::Axes; ++a)
+	{
+		double mean = 0.0;
+		for (double x : increments[a])
+			mean += x;
+		mean /= count;
+		analysis.mean[a] = mean / analysis.sampleInterval;
+
+		integral[a].resize(count + 1);
+		integral[a][0] = 0.0;
+		for (size_t i = 0; i < count; ++i)
+			integral[a][i + 1] = integral[a][i] + (increments[a][i] - mean);
+	}
+	return true;
+}
+}
+
+/*! \brief Convert the noise terms of the six axes to filter noise settings
+	\details Uses the average over the three axes of each sensor. Terms that none of the axes show
+	keep their value from \a defaults.
+	\param defaults The settings for the terms that could not be determined
+	\returns The filter noise settings
+*/
+FilterNoise AllanAnalysis::filterNoise(const FilterNoise& defaults) const
+{
+	double randomWalk[Axes];
+	double rateRandomWalk[Axes];
+	for (int a = 0; a < Axes; ++a)
+	{
+		randomWalk[a] = terms[a].randomWalk;
+		rateRandomWalk[a] = terms[a].rateRandomWalk;
+	}
+
+	FilterNoise noise = defaults;
+	if (double value = meanOfNonZero(randomWalk, 3))
+		noise.gyroNoise = value;
+	if (double value = meanOfNonZero(randomWalk + 3, 3))
+		noise.accelerationNoise = value;
+	if (double value = meanOfNonZero(rateRandomWalk, 3))
+		noise.gyroBiasRandomWalk = value;
+	if (double value = meanOfNonZero(rateRandomWalk + 3, 3))
+		noise.accelerationBiasRandomWalk = value;
+	return noise;
+}
+
+/*! \brief Cluster sizes, in samples, spaced evenly on a logarithmic scale
+	\param sampleCount The number of samples of the recording
+	\param perDecade The number of cluster sizes per factor 10
+	\returns Unique cluster sizes from 1 up to the largest one with at least two clusters
+*/
+vector<size_t> allanClusterSizes(size_t sampleCount, size_t perDecade)
+{
+	vector<size_t> sizes;
+	size_t largest = sampleCount / 2;
+	perDecade = max<size_t>(perDecade, 1);
+	for (size_t k = 0;; ++k)
+	{
+		size_t m = static_cast<size_t>(floor(pow(10.0, static_cast<double>(k) / perDecade)));
+		if (m > largest)
+			break;
+		if (sizes.empty() || m != sizes.back())
+			sizes.push_back(m);
+	}
+	return sizes;
+}
+
+/*! \brief Overlapping Allan variance of one cluster size, from the integral of the signal
+	\details With the cumulative sum theta, the difference of the means of two adjacent clusters
+	starting at k is (theta[k+2m] - 2 theta[k+m] + theta[k]) / tau, so every cluster size costs a
+	single pass over the data instead of summing each cluster.
+	\param integral Cumulative sum of the per-sample increments, starting at 0
+	\param clusterSize The number of samples per cluster
+	\param sampleInterval The sample interval in s
+	\returns The Allan variance, in the squared unit of increment per second
+*/
+double overlappingAllanVariance(const vector<double>& integral, size_t clusterSize, double sampleInterval)
+{
+	size_t m = clusterSize;
+	if (m == 0 || integral.size() <= 2 * m)
+		return 0.0;
+
+	size_t terms = integral.size() - 2 * m;
+	const double* theta = integral.data();
+	double sum = 0.0;
+	for (size_t k = 0; k < terms; ++k)
+	{
+		double d = theta[k + 2 * m] - 2.0 * theta[k + m] + theta[k];
+		sum += d * d;
+	}
+
+	double tau = m * sampleInterval;
+	return sum / (2.0 * tau * tau * terms);
+}
+
+/*! \brief Read the white noise, bias instability and rate random walk terms off a curve
+	\details The random walk terms are fitted to the segments whose log-log slope is close to -1/2
+	and +1/2 respectively. Without a -1/2 segment the shortest averaging time is assumed to be white
+	noise dominated.
+	\param curve The Allan deviation curve
+	\returns The noise terms
+*/
+NoiseTerms noiseTerms(const AllanCurve& curve)
+{
+	NoiseTerms terms;
+	size_t count = min(curve.tau.size(), curve.deviation.size());
+	if (count == 0)
+		return terms;
+
+	size_t minimum = 0;
+	for (size_t i = 1; i < count; ++i)
+		if (curve.deviation[i] > 0.0 && curve.deviation[i] < curve.deviation[minimum])
+			minimum = i;
+	terms.biasInstability = curve.deviation[minimum] / BIAS_INSTABILITY_FACTOR;
+	terms.biasInstabilityTau = curve.tau[minimum];
+
+	double whiteSum = 0.0;
+	size_t whiteCount = 0;
+	double rateSum = 0.0;
+	size_t rateCount = 0;
+	for (size_t i = 0; i + 1 < count; ++i)
+	{
+		double tau0 = curve.tau[i], tau1 = curve.tau[i + 1];
+		double sigma0 = curve.deviation[i], sigma1 = curve.deviation[i + 1];
+		if (sigma0 <= 0.0 || sigma1 <= 0.0)
+			continue;
+
+		double slope = log(sigma1 / sigma0) / log(tau1 / tau0);
+		if (i < minimum && fabs(slope + 0.5) < SLOPE_TOLERANCE)
+		{
+			// sigma = N / sqrt(tau)
+			whiteSum += log(sigma0 * sqrt(tau0)) + log(sigma1 * sqrt(tau1));
+			whiteCount += 2;
+		}
+		else if (i >= minimum && fabs(slope - 0.5) < SLOPE_TOLERANCE)
+		{
+			// sigma = K sqrt(tau / 3)
+			rateSum += log(sigma0 * sqrt(3.0 / tau0)) + log(sigma1 * sqrt(3.0 / tau1));
+			rateCount += 2;
+		}
+	}
+
+	terms.randomWalk = whiteCount ? exp(whiteSum / whiteCount) : curve.deviation[0] * sqrt(curve.tau[0]);
+	terms.rateRandomWalk = rateCount ? exp(rateSum / rateCount) : 0.0;
+	return terms;
+}
+
+/*! \brief Compute the Allan deviation curves and noise terms of a set of static logfiles
+	\details The files are read in parallel, then every combination of file, axis and cluster size
+	is a separate task spread over all cores.
+	\param fileNames The delta quantities logfiles
+	\param results Receives one analysis per file, in the same order, with sampleCount 0 for files
+	that could not be read
+	\param perDecade The number of cluster sizes per factor 10
+	\returns The number of files that were analyzed
+*/
+size_t analyzeLogFiles(const vector<string>& fileNames, vector<AllanAnalysis>& results, size_t perDecade)
+{
+	vector<array<vector<double>, AllanAnalysis::Axes>> integrals(fileNames.size());
+	results.assign(fileNames.size(), AllanAnalysis());
+	parallelFor(fileNames.size(), [&](size_t f)
+	{
+		if (!integrateLogFile(fileNames[f], results[f], integrals[f]))
+		{
+			results[f] = AllanAnalysis();
+			results[f].fileName = fileNames[f];
+		}
+	});
+
+	struct Task
+	{
+		size_t file;
+		int axis;
+		size_t point;
+		size_t clusterSize;
+	};
+	vector<Task> tasks;
+	size_t analyzed = 0;
+	for (size_t f = 0; f < results.size(); ++f)
+	{
+		AllanAnalysis& analysis = results[f];
+		if (analysis.sampleCount == 0)
+			continue;
+		++analyzed;
+
+		vector<size_t> sizes = allanClusterSizes(analysis.sampleCount, perDecade);
+		for (int a = 0; a < AllanAnalysis::Axes; ++a)
+		{
+			analysis.curves[a].tau.resize(sizes.size());
+			analysis.curves[a].deviation.resize(sizes.size());
+			for (size_t p = 0; p < sizes.size(); ++p)
+			{
+				analysis.curves[a].tau[p] = sizes[p] * analysis.sampleInterval;
+				tasks.push_back({ f, a, p, sizes[p] });
+			}
+		}
+	}
+
+	// Small clusters have the most terms, start with them so the cheap tasks even out the end
+	sort(tasks.begin(), tasks.end(), [](const Task& x, const Task& y) { return x.clusterSize < y.clusterSize; });
+	parallelFor(tasks.size(), [&](size_t t)
+	{
+		const Task& task = tasks[t];
+		AllanAnalysis& analysis = results[task.file];
+		double variance = overlappingAllanVariance(integrals[task.file][task.axis], task.clusterSize, analysis.sampleInterval);
+		analysis.curves[task.axis].deviation[task.point] = sqrt(variance);
+	});
+
+	for (auto& analysis : results)
+		for (int a = 0; a < AllanAnalysis::Axes && analysis.sampleCount; ++a)
+			analysis.terms[a] = noiseTerms(analysis.curves[a]);
+	return analyzed;
+}
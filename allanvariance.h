@@ -0,0 +1,50 @@
+#ifndef ALLAN_VARIANCE_H
+#define ALLAN_VARIANCE_H
+
+#include "errorstatefilter.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*! \brief Overlapping Allan deviation of one axis at a set of averaging times */
+struct AllanCurve
+{
+	std::vector<double> tau;		//!< Averaging times in s
+	std::vector<double> deviation;	//!< Allan deviation at each averaging time, in rad/s or m/s^2
+};
+
+/*! \brief Noise terms read off an Allan deviation curve, 0 when the curve does not show the term */
+struct NoiseTerms
+{
+	double randomWalk = 0.0;			//!< Slope -1/2 line at 1 s: angle random walk in rad/s/sqrt(Hz) or velocity random walk in m/s^2/sqrt(Hz)
+	double biasInstability = 0.0;		//!< Minimum of the curve divided by 0.664, in rad/s or m/s^2
+	double biasInstabilityTau = 0.0;	//!< Averaging time of the minimum in s
+	double rateRandomWalk = 0.0;		//!< Slope +1/2 line at 3 s: bias random walk in rad/s^2/sqrt(Hz) or m/s^3/sqrt(Hz)
+};
+
+/*! \brief Allan analysis of the six axes of one static delta quantities logfile
+	\details Axes 0-2 are the gyroscope in rad/s, axes 3-5 the accelerometer in m/s^2, both in the
+	sensor frame.
+*/
+struct AllanAnalysis
+{
+	static constexpr int Axes = 6;
+
+	std::string fileName;
+	std::string bluetoothAddress;
+	size_t sampleCount = 0;
+	double sampleInterval = 0.0;	//!< s
+	double mean[Axes] = {};			//!< Mean rate, the gyroscope bias and the specific force
+	AllanCurve curves[Axes];
+	NoiseTerms terms[Axes];
+
+	FilterNoise filterNoise(const FilterNoise& defaults = FilterNoise()) const;
+};
+
+std::vector<size_t> allanClusterSizes(size_t sampleCount, size_t perDecade = 10);
+double overlappingAllanVariance(const std::vector<double>& integral, size_t clusterSize, double sampleInterval);
+NoiseTerms noiseTerms(const AllanCurve& curve);
+size_t analyzeLogFiles(const std::vector<std::string>& fileNames, std::vector<AllanAnalysis>& results, size_t perDecade = 10);
+
+#endif
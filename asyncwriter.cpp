@@ -0,0 +1,590 @@
+#include "asyncwriter.h"
+
+#include "realtime.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+int64_t nowNs()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t roundUpToBlock(size_t size)
+{
+	return (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+}
+
+//! Raises \a value to at least \a candidate
+template <class T>
+void updateMax(atomic<T>& value, T candidate)
+{
+	T current = value.load(memory_order_relaxed);
+	while (candidate > current && !value.compare_exchange_weak(current, candidate, memory_order_relaxed))
+		;
+}
+}
+
+/*! \brief Minimal io_uring submission and completion rings, used directly through the system calls
+	\details Only the writer thread touches the rings, the kernel is the other side of both.
+*/
+struct AsyncWriter::Ring
+{
+	int fd = -1;
+	void* sqMap = MAP_FAILED;
+	void* cqMap = MAP_FAILED;
+	size_t sqMapSize = 0;
+	size_t cqMapSize = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqesSize = 0;
+
+	unsigned* sqHead = nullptr;
+	unsigned* sqTail = nullptr;
+	unsigned* sqMask = nullptr;
+	unsigned* sqArray = nullptr;
+	unsigned sqEntries = 0;
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	unsigned* cqMask = nullptr;
+	io_uring_cqe* cqes = nullptr;
+	unsigned unsubmitted = 0;
+
+	~Ring()
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqMap != MAP_FAILED && cqMap != sqMap)
+			munmap(cqMap, cqMapSize);
+		if (sqMap != MAP_FAILED)
+			munmap(sqMap, sqMapSize);
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	/*! \brief Create the rings
+		\returns False if io_uring is unavailable or does not support IORING_OP_WRITE (before Linux 5.6)
+	*/
+	bool init(unsigned entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (fd < 0)
+			return false;
+
+		sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMap)
+			sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+
+		sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sqMap == MAP_FAILED)
+			return false;
+		cqMap = singleMap ? sqMap : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqMap == MAP_FAILED)
+			return false;
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED)
+			return false;
+
+		char* sq = static_cast<char*>(sqMap);
+		sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		sqEntries = params.sq_entries;
+		char* cq = static_cast<char*>(cqMap);
+		cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		vector<char> probeMemory(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+		io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probeMemory.data());
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+			return false;
+		return probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	//! Queue a write, returns false if the submission ring is full
+	bool prepareWrite(int file, const void* data, size_t length, uint64_t offset, uint64_t userData)
+	{
+		unsigned tail = *sqTail;
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+			return false;
+
+		unsigned index = tail & *sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = file;
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = static_cast<uint32_t>(length);
+		sqe->off = offset;
+		sqe->user_data = userData;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		++unsubmitted;
+		return true;
+	}
+
+	//! Submit the queued writes and wait until at least one completion is available
+	bool submitAndWait()
+	{
+		int result = static_cast<int>(syscall(__NR_io_uring_enter, fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (result < 0)
+			return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+		unsubmitted -= min<unsigned>(unsubmitted, static_cast<unsigned>(result));
+		return true;
+	}
+
+	//! Take the oldest completion, returns false if there is none
+	bool popCompletion(io_uring_cqe& cqe)
+	{
+		unsigned head = *cqHead;
+		if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			return false;
+		cqe = cqes[head & *cqMask];
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+/*! \brief Constructor */
+AsyncWriter::AsyncWriter()
+	: m_fd(-1)
+	, m_memory(nullptr)
+	, m_current(0)
+	, m_used(0)
+	, m_logicalSize(0)
+	, m_nextOffset(0)
+	, m_ring(nullptr)
+	, m_usingIoUring(false)
+	, m_filled(nullptr)
+	, m_free(nullptr)
+	, m_stopping(false)
+	, m_failed(false)
+	, m_bytesWritten(0)
+	, m_buffersWritten(0)
+	, m_inFlight(0)
+	, m_maxQueueDepth(0)
+	, m_latencySumNs(0)
+	, m_latencyMaxNs(0)
+	, m_producerStalls(0)
+	, m_producerStallNs(0)
+	, m_buffersSinceSync(0)
+{
+}
+
+/*! \brief Destructor, writes out the remaining data */
+AsyncWriter::~AsyncWriter()
+{
+	close();
+}
+
+/*! \brief Create, truncate or append to a file and start the writer thread
+	\details When the file system does not support O_DIRECT the file is opened without it
+	\param fileName The file to write
+	\param settings Buffering, I/O method and sync policy
+	\param keepSize The number of bytes of an existing file to keep and append to, -1 to truncate it
+	\returns False if the file could not be created or the buffers could not be allocated
+*/
+bool AsyncWriter::open(const string& fileName, const AsyncWriterSettings& settings, int64_t keepSize)
+{
+	close();
+
+	m_settings = settings;
+	m_settings.bufferSize = roundUpToBlock(max<size_t>(settings.bufferSize, 1));
+	m_settings.bufferCount = max<size_t>(settings.bufferCount, 2);
+	m_settings.syncInterval = max<size_t>(settings.syncInterval, 1);
+
+	// Appending rereads the partial block at the end of the kept data, O_DIRECT writes whole blocks
+	int flags = (keepSize < 0 ? O_WRONLY | O_TRUNC : O_RDWR) | O_CREAT | O_CLOEXEC;
+	m_fd = -1;
+	if (m_settings.directIo)
+		m_fd = ::open(fileName.c_str(), flags | O_DIRECT, 0644);
+	if (m_fd < 0)
+	{
+		m_settings.directIo = false;
+		m_fd = ::open(fileName.c_str(), flags, 0644);
+	}
+	if (m_fd < 0)
+		return false;
+	// Also cuts off a partly written record or the block padding left behind by a crash
+	if (keepSize >= 0 && ftruncate(m_fd, static_cast<off_t>(keepSize)) != 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+
+	void* memory = nullptr;
+	if (posix_memalign(&memory, DIRECT_IO_ALIGNMENT, m_settings.bufferSize * m_settings.bufferCount) != 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	// Touch every page now, so no page fault happens in write()
+	m_memory = static_cast<char*>(memory);
+	memset(m_memory, 0, m_settings.bufferSize * m_settings.bufferCount);
+
+	m_filled = new SpscQueue<Block>(m_settings.bufferCount);
+	m_free = new SpscQueue<uint32_t>(m_settings.bufferCount);
+	for (uint32_t i = 1; i < m_settings.bufferCount; ++i)
+		m_free->push(i);
+	m_current = 0;
+	m_used = 0;
+	m_logicalSize = 0;
+	m_nextOffset = 0;
+	if (keepSize >= 0)
+	{
+		// Continue in the block the kept data ends in, it is written again with the new data
+		uint64_t base = static_cast<uint64_t>(keepSize) & ~static_cast<uint64_t>(DIRECT_IO_ALIGNMENT - 1);
+		size_t tail = static_cast<size_t>(keepSize - base);
+		if (tail && pread(m_fd, m_memory, DIRECT_IO_ALIGNMENT, static_cast<off_t>(base)) < static_cast<ssize_t>(tail))
+		{
+			releaseBuffers();
+			::close(m_fd);
+			m_fd = -1;
+			return false;
+		}
+		m_used = tail;
+		m_logicalSize = static_cast<uint64_t>(keepSize);
+		m_nextOffset = base;
+	}
+
+	m_stopping = false;
+	m_failed = false;
+	m_bytesWritten = 0;
+	m_buffersWritten = 0;
+	m_inFlight = 0;
+	m_maxQueueDepth = 0;
+	m_latencySumNs = 0;
+	m_latencyMaxNs = 0;
+	m_producerStalls = 0;
+	m_producerStallNs = 0;
+	m_buffersSinceSync = 0;
+
+	if (m_settings.useIoUring)
+	{
+		m_ring = new Ring;
+		if (!m_ring->init(static_cast<unsigned>(m_settings.bufferCount)))
+		{
+			delete m_ring;
+			m_ring = nullptr;
+		}
+	}
+	m_usingIoUring = m_ring != nullptr;
+
+	m_thread = thread(&AsyncWriter::run, this);
+	return true;
+}
+
+/*! \brief Append data to the file
+	\details Only copies into the current buffer, unless all buffers are waiting for the disk
+	\param data The data to append
+	\param size The number of bytes to append
+	\returns False if the file is not open or the writer thread failed to write
+*/
+bool AsyncWriter::write(const void* data, size_t size)
+{
+	if (m_fd < 0)
+		return false;
+
+	const char* bytes = static_cast<const char*>(data);
+	m_logicalSize += size;
+	while (size)
+	{
+		size_t count = min(size, m_settings.bufferSize - m_used);
+		memcpy(m_memory + m_current * m_settings.bufferSize + m_used, bytes, count);
+		m_used += count;
+		bytes += count;
+		size -= count;
+		if (m_used == m_settings.bufferSize && !submitCurrent(m_used))
+			return false;
+	}
+	return !m_failed.load(memory_order_relaxed);
+}
+
+/*! \brief Hand the data written so far to the writer thread without waiting for it
+	\details With O_DIRECT only whole blocks are handed over, the rest stays buffered until the next
+	flush or close
+*/
+void AsyncWriter::flush()
+{
+	if (m_fd < 0)
+		return;
+
+	size_t length = m_settings.directIo ? m_used & ~(DIRECT_IO_ALIGNMENT - 1) : m_used;
+	if (length)
+		submitCurrent(length);
+}
+
+/*! \brief Write the remaining data, stop the writer thread and close the file
+	\returns False if any write or the final sync failed
+*/
+bool AsyncWriter::close()
+{
+	if (m_fd < 0)
+		return true;
+
+	if (m_used)
+	{
+		// O_DIRECT writes whole blocks, the padding is truncated again once everything is written
+		size_t length = m_settings.directIo ? roundUpToBlock(m_used) : m_used;
+		memset(m_memory + m_current * m_settings.bufferSize + m_used, 0, length - m_used);
+		m_filled->push({ static_cast<uint32_t>(m_current), static_cast<uint32_t>(length) });
+		m_inFlight.fetch_add(1, memory_order_relaxed);
+		m_used = 0;
+	}
+
+	m_stopping.store(true, memory_order_release);
+	m_wake.notify_one();
+	m_thread.join();
+
+	bool ok = finishFile();
+	releaseBuffers();
+	return ok;
+}
+
+/*! \returns True if a file is open */
+bool AsyncWriter::isOpen() const
+{
+	return m_fd >= 0;
+}
+
+/*! \returns A snapshot of the queue and latency statistics of the current or last file */
+AsyncWriterStats AsyncWriter::stats() const
+{
+	AsyncWriterStats stats;
+	stats.bytesWritten = m_bytesWritten.load(memory_order_relaxed);
+	stats.buffersWritten = m_buffersWritten.load(memory_order_relaxed);
+	stats.queueDepth = m_inFlight.load(memory_order_relaxed);
+	stats.maxQueueDepth = m_maxQueueDepth.load(memory_order_relaxed);
+	if (stats.buffersWritten)
+		stats.meanWriteLatencyUs = m_latencySumNs.load(memory_order_relaxed) / 1e3 / stats.buffersWritten;
+	stats.maxWriteLatencyUs = m_latencyMaxNs.load(memory_order_relaxed) / 1e3;
+	stats.producerStalls = m_producerStalls;
+	stats.producerStallMs = m_producerStallNs / 1e6;
+	stats.usingIoUring = m_usingIoUring;
+	stats.failed = m_failed.load(memory_order_relaxed);
+	return stats;
+}
+
+/*! \brief Queue the first \a length bytes of the current buffer and continue in a free buffer
+	\details Bytes beyond \a length are moved to the start of the next buffer
+	\returns False if the writer thread failed
+*/
+bool AsyncWriter::submitCurrent(size_t length)
+{
+	size_t remainder = m_used - length;
+	char* previous = m_memory + m_current * m_settings.bufferSize;
+
+	m_filled->push({ static_cast<uint32_t>(m_current), static_cast<uint32_t>(length) });
+	size_t depth = m_inFlight.fetch_add(1, memory_order_relaxed) + 1;
+	updateMax(m_maxQueueDepth, depth);
+	m_wake.notify_one();
+
+	uint32_t next;
+	if (!m_free->pop(next))
+	{
+		// Every buffer is waiting for the disk, this is the only place the caller blocks
+		int64_t start = nowNs();
+		++m_producerStalls;
+		while (!m_free->pop(next))
+			this_thread::sleep_for(chrono::microseconds(50));
+		m_producerStallNs += nowNs() - start;
+	}
+
+	// The previous buffer may already be written and handed out again as the next one, the
+	// writer only reads from it, so its contents are still intact
+	m_current = next;
+	if (remainder)
+		memmove(m_memory + m_current * m_settings.bufferSize, previous + length, remainder);
+	m_used = remainder;
+	return !m_failed.load(memory_order_relaxed);
+}
+
+/*! \brief Free the buffers and queues after the writer thread has stopped */
+void AsyncWriter::releaseBuffers()
+{
+	delete m_ring;
+	m_ring = nullptr;
+	delete m_filled;
+	m_filled = nullptr;
+	delete m_free;
+	m_free = nullptr;
+	free(m_memory);
+	m_memory = nullptr;
+	m_current = 0;
+	m_used = 0;
+}
+
+/*! \brief The writer thread */
+void AsyncWriter::run()
+{
+	if (!m_settings.cpus.empty() || m_settings.fifoPriority > 0)
+		setThreadRealtime("writer", m_settings.cpus, m_settings.fifoPriority);
+
+	if (m_ring)
+		runIoUring();
+	else
+		runPwrite();
+}
+
+/*! \brief Keep up to one write per buffer in flight through io_uring, until stopped and drained */
+void AsyncWriter::runIoUring()
+{
+	struct Request
+	{
+		Block block;
+		uint64_t offset;
+		size_t done;
+		int64_t startNs;
+	};
+	vector<Request> requests(m_settings.bufferCount);
+	size_t inFlight = 0;
+
+	for (;;)
+	{
+		bool stopping = m_stopping.load(memory_order_acquire);
+		Block block;
+		while (m_filled->pop(block))
+		{
+			Request& request = requests[block.buffer];
+			request = { block, m_nextOffset, 0, nowNs() };
+			m_nextOffset += block.length;
+			m_ring->prepareWrite(m_fd, m_memory + block.buffer * m_settings.bufferSize, block.length, request.offset, block.buffer);
+			++inFlight;
+		}
+
+		if (inFlight == 0)
+		{
+			if (stopping)
+				return;
+			unique_lock<mutex> lock(m_wakeMutex);
+			m_wake.wait_for(lock, chrono::milliseconds(2));
+			continue;
+		}
+
+		if (!m_ring->submitAndWait())
+		{
+			// The ring is unusable, writes still in flight may or may not reach the disk
+			m_failed = true;
+			for (auto& request : requests)
+				if (request.done < request.block.length)
+					completeBlock(request.block, 0);
+			runPwrite();
+			return;
+		}
+
+		io_uring_cqe cqe;
+		while (m_ring->popCompletion(cqe))
+		{
+			Request& request = requests[cqe.user_data];
+			if (cqe.res > 0)
+				request.done += static_cast<size_t>(cqe.res);
+			else if (cqe.res != -EINTR && cqe.res != -EAGAIN)
+			{
+				m_failed = true;
+				request.done = request.block.length;
+			}
+
+			if (request.done < request.block.length)
+			{
+				// Short write, continue with the rest
+				m_ring->prepareWrite(m_fd, m_memory + request.block.buffer * m_settings.bufferSize + request.done,
+					request.block.length - request.done, request.offset + request.done, request.block.buffer);
+				continue;
+			}
+			--inFlight;
+			completeBlock(request.block, nowNs() - request.startNs);
+		}
+	}
+}
+
+/*! \brief Write the queued buffers one at a time with pwrite, until stopped and drained */
+void AsyncWriter::runPwrite()
+{
+	for (;;)
+	{
+		bool stopping = m_stopping.load(memory_order_acquire);
+		Block block;
+		if (!m_filled->pop(block))
+		{
+			if (stopping)
+				return;
+			unique_lock<mutex> lock(m_wakeMutex);
+			m_wake.wait_for(lock, chrono::milliseconds(2));
+			continue;
+		}
+
+		int64_t start = nowNs();
+		const char* data = m_memory + block.buffer * m_settings.bufferSize;
+		size_t done = 0;
+		while (done < block.length && !m_failed.load(memory_order_relaxed))
+		{
+			ssize_t result = pwrite(m_fd, data + done, block.length - done, static_cast<off_t>(m_nextOffset + done));
+			if (result > 0)
+				done += static_cast<size_t>(result);
+			else if (result < 0 && errno != EINTR)
+				m_failed = true;
+		}
+		m_nextOffset += block.length;
+		completeBlock(block, nowNs() - start);
+	}
+}
+
+/*! \brief Account for a written buffer, sync if the policy asks for it and return the buffer */
+void AsyncWriter::completeBlock(const Block& block, int64_t latencyNs)
+{
+	m_bytesWritten.fetch_add(block.length, memory_order_relaxed);
+	m_buffersWritten.fetch_add(1, memory_order_relaxed);
+	m_latencySumNs.fetch_add(latencyNs, memory_order_relaxed);
+	updateMax(m_latencyMaxNs, latencyNs);
+
+	if (m_settings.syncPolicy == SyncPolicy::Periodic && ++m_buffersSinceSync >= m_settings.syncInterval)
+	{
+		if (fdatasync(m_fd) != 0)
+			m_failed = true;
+		m_buffersSinceSync = 0;
+	}
+
+	m_inFlight.fetch_sub(1, memory_order_relaxed);
+	m_free->push(block.buffer);
+}
+
+/*! \brief Remove the O_DIRECT padding, sync according to the policy and close the file
+	\returns False if anything failed during the lifetime of the file
+*/
+bool AsyncWriter::finishFile()
+{
+	bool ok = !m_failed.load();
+	if (m_settings.directIo && ftruncate(m_fd, static_cast<off_t>(m_logicalSize)) != 0)
+		ok = false;
+	if (m_settings.syncPolicy != SyncPolicy::None && fdatasync(m_fd) != 0)
+		ok = false;
+	if (::close(m_fd) != 0)
+		ok = false;
+	m_fd = -1;
+	return ok;
+}
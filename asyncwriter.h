@@ -0,0 +1,122 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include "spscqueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*! \brief When the writer thread flushes the file to the disk */
+enum class SyncPolicy
+{
+	None,		//!< Leave it to the operating system
+	OnClose,	//!< fdatasync once when the file is closed
+	Periodic	//!< fdatasync after every syncInterval buffers and on close
+};
+
+struct AsyncWriterSettings
+{
+	size_t bufferSize = 1 << 20;	//!< Rounded up to a multiple of the 4 KiB block size
+	size_t bufferCount = 8;			//!< Preallocated buffers, also the maximum number of writes in flight
+	bool directIo = false;			//!< Open with O_DIRECT, bypassing the page cache
+	bool useIoUring = true;			//!< Submit writes with io_uring when the kernel supports it, otherwise pwrite
+	SyncPolicy syncPolicy = SyncPolicy::OnClose;
+	size_t syncInterval = 16;
+	std::vector<int> cpus;			//!< Cores for the writer thread, empty for any core
+	int fifoPriority = 0;			//!< SCHED_FIFO priority of the writer thread, 0 for the normal scheduler
+};
+
+struct AsyncWriterStats
+{
+	uint64_t bytesWritten = 0;
+	uint64_t buffersWritten = 0;
+	size_t queueDepth = 0;			//!< Filled buffers waiting for or in the middle of being written
+	size_t maxQueueDepth = 0;
+	double meanWriteLatencyUs = 0.0;
+	double maxWriteLatencyUs = 0.0;
+	uint64_t producerStalls = 0;	//!< Times write() had to wait for a free buffer
+	double producerStallMs = 0.0;	//!< Total time write() spent waiting
+	bool usingIoUring = false;
+	bool failed = false;
+};
+
+/*! \brief Appends to a file from a background thread, so the caller never waits for the disk
+	\details write() copies into one of a set of preallocated, block aligned buffers. Full buffers
+	are handed to the writer thread through a lock-free queue and come back through a second one
+	once they are on disk, so the caller only blocks when all buffers are in flight, which is
+	counted in the statistics. The writer thread submits the buffers with io_uring, keeping
+	several writes in flight, or with pwrite when io_uring is not available.
+
+	write(), flush(), close() and stats() must be called from one thread.
+*/
+class AsyncWriter
+{
+public:
+	AsyncWriter();
+	~AsyncWriter();
+
+	bool open(const std::string& fileName, const AsyncWriterSettings& settings = AsyncWriterSettings(), int64_t keepSize = -1);
+	bool write(const void* data, size_t size);
+	void flush();
+	bool close();
+	bool isOpen() const;
+
+	AsyncWriterStats stats() const;
+
+private:
+	AsyncWriter(const AsyncWriter&) = delete;
+	AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+	struct Ring;
+
+	//! A filled buffer handed to the writer thread
+	struct Block
+	{
+		uint32_t buffer;
+		uint32_t length;
+	};
+
+	bool submitCurrent(size_t length);
+	void releaseBuffers();
+	void run();
+	void runIoUring();
+	void runPwrite();
+	void completeBlock(const Block& block, int64_t latencyNs);
+	bool finishFile();
+
+	AsyncWriterSettings m_settings;
+	int m_fd;
+	char* m_memory;
+	size_t m_current;
+	size_t m_used;
+	uint64_t m_logicalSize;
+	uint64_t m_nextOffset;
+	Ring* m_ring;
+	bool m_usingIoUring;
+
+	SpscQueue<Block>* m_filled;
+	SpscQueue<uint32_t>* m_free;
+	std::thread m_thread;
+	std::mutex m_wakeMutex;
+	std::condition_variable m_wake;
+	std::atomic<bool> m_stopping;
+	std::atomic<bool> m_failed;
+
+	std::atomic<uint64_t> m_bytesWritten;
+	std::atomic<uint64_t> m_buffersWritten;
+	std::atomic<size_t> m_inFlight;
+	std::atomic<size_t> m_maxQueueDepth;
+	std::atomic<int64_t> m_latencySumNs;
+	std::atomic<int64_t> m_latencyMaxNs;
+	uint64_t m_producerStalls;
+	int64_t m_producerStallNs;
+	size_t m_buffersSinceSync;
+};
+
+#endif
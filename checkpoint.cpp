@@ -0,0 +1,246 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(is_trivially_copyable<DeviceCheckpoint>::value, "DeviceCheckpoint is copied into the mapping as raw memory");
+
+namespace
+{
+const char CHECKPOINT_MAGIC[8] = { 'I', 'M', 'U', 'C', 'K', 'P', 'T', '\0' };
+const uint32_t CHECKPOINT_VERSION = 3;
+const size_t SLOT_OFFSET = 64;
+
+array<uint32_t, 256> makeCrcTable()
+{
+	array<uint32_t, 256> table;
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		table[i] = c;
+	}
+	return table;
+}
+
+uint32_t crc32(uint32_t crc, const void* data, size_t length)
+{
+	static const array<uint32_t, 256> table = makeCrcTable();
+
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	while (length--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+}
+
+struct CheckpointFile::Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t maxDevices;
+	uint32_t recordSize;
+	uint32_t reserved;
+};
+
+struct CheckpointFile::Slot
+{
+	uint64_t sequence;
+	int64_t timestamp;
+	uint32_t deviceCount;
+	uint32_t crc;
+
+	DeviceCheckpoint* devices() { return reinterpret_cast<DeviceCheckpoint*>(this + 1); }
+
+	uint32_t checksum()
+	{
+		uint32_t crc = crc32(0, &timestamp, sizeof(timestamp));
+		crc = crc32(crc, &deviceCount, sizeof(deviceCount));
+		return crc32(crc, devices(), deviceCount * sizeof(DeviceCheckpoint));
+	}
+};
+
+/*! \brief Constructor */
+CheckpointFile::CheckpointFile()
+	: m_fd(-1)
+	, m_map(nullptr)
+	, m_mapSize(0)
+	, m_maxDevices(0)
+	, m_sequence(0)
+	, m_latestSlot(-1)
+{
+}
+
+/*! \brief Destructor, unmaps the file */
+CheckpointFile::~CheckpointFile()
+{
+	close();
+}
+
+/*! \brief Open or create a checkpoint file and map it into memory
+	\details An existing file with a different layout is reinitialized, which discards its snapshots
+	\param fileName The checkpoint file
+	\param maxDevices The maximum number of devices a snapshot can hold
+	\returns False if the file could not be created or mapped
+*/
+bool CheckpointFile::open(const string& fileName, size_t maxDevices)
+{
+	close();
+
+	m_fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_fd < 0)
+		return false;
+
+	m_maxDevices = maxDevices;
+	m_mapSize = SLOT_OFFSET + 2 * slotSize();
+
+	struct stat info;
+	bool reinitialize = fstat(m_fd, &info) != 0 || static_cast<size_t>(info.st_size) != m_mapSize;
+	if (reinitialize && ftruncate(m_fd, 0) != 0)
+	{
+		close();
+		return false;
+	}
+	if (reinitialize && ftruncate(m_fd, static_cast<off_t>(m_mapSize)) != 0)
+	{
+		close();
+		return false;
+	}
+
+	m_map = mmap(nullptr, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (m_map == MAP_FAILED)
+	{
+		m_map = nullptr;
+		close();
+		return false;
+	}
+
+	Header* header = static_cast<Header*>(m_map);
+	if (reinitialize || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0
+		|| header->version != CHECKPOINT_VERSION || header->maxDevices != maxDevices
+		|| header->recordSize != sizeof(DeviceCheckpoint))
+	{
+		memset(m_map, 0, m_mapSize);
+		memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+		header->version = CHECKPOINT_VERSION;
+		header->maxDevices = static_cast<uint32_t>(maxDevices);
+		header->recordSize = sizeof(DeviceCheckpoint);
+	}
+
+	m_sequence = max(slot(0)->sequence, slot(1)->sequence);
+	m_latestSlot = latestValidSlot();
+	return true;
+}
+
+/*! \brief Unmap and close the checkpoint file, the last snapshot stays in the file */
+void CheckpointFile::close()
+{
+	if (m_map)
+		munmap(m_map, m_mapSize);
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_map = nullptr;
+	m_fd = -1;
+	m_mapSize = 0;
+	m_sequence = 0;
+	m_latestSlot = -1;
+}
+
+/*! \returns True if a checkpoint file is mapped */
+bool CheckpointFile::isOpen() const
+{
+	return m_map != nullptr;
+}
+
+/*! \brief Read the latest valid snapshot
+	\param devices Receives the device states of the snapshot
+	\param timestamp Receives the host time at which the snapshot was saved
+	\returns False if the file holds no valid snapshot
+*/
+bool CheckpointFile::load(vector<DeviceCheckpoint>& devices, int64_t& timestamp) const
+{
+	if (!m_map)
+		return false;
+
+	int latest = latestValidSlot();
+	if (latest < 0)
+		return false;
+
+	Slot* best = slot(latest);
+	devices.assign(best->devices(), best->devices() + best->deviceCount);
+	timestamp = best->timestamp;
+	return true;
+}
+
+/*! \brief Store a snapshot in the slot that does not hold the latest one
+	\param devices The device states to store, at most the number of devices the file was opened for
+	\param timestamp The host time of the snapshot
+	\returns False if the file is not open or there are too many devices
+*/
+bool CheckpointFile::save(const vector<DeviceCheckpoint>& devices, int64_t timestamp)
+{
+	if (!m_map || devices.size() > m_maxDevices)
+		return false;
+
+	// Never overwrite the latest valid snapshot, whatever the state of the other slot
+	int target = m_latestSlot == 0 ? 1 : 0;
+	Slot* s = slot(target);
+	s->timestamp = timestamp;
+	s->deviceCount = static_cast<uint32_t>(devices.size());
+	if (!devices.empty())
+		memcpy(s->devices(), devices.data(), devices.size() * sizeof(DeviceCheckpoint));
+	s->crc = s->checksum();
+
+	// Publish the slot only after its contents are in place
+	atomic_thread_fence(memory_order_release);
+	*reinterpret_cast<volatile uint64_t*>(&s->sequence) = ++m_sequence;
+	m_latestSlot = target;
+	return true;
+}
+
+/*! \brief Flush the mapping to disk, so the latest snapshot also survives a power loss
+	\returns False if the flush failed
+*/
+bool CheckpointFile::sync()
+{
+	return m_map && msync(m_map, m_mapSize, MS_SYNC) == 0;
+}
+
+/*! \returns The index of the valid slot with the highest sequence number, or -1 if neither slot is valid */
+int CheckpointFile::latestValidSlot() const
+{
+	int latest = -1;
+	for (int i = 0; i < 2; ++i)
+	{
+		Slot* s = slot(i);
+		if (s->sequence == 0 || s->deviceCount > m_maxDevices || s->checksum() != s->crc)
+			continue;
+		if (latest < 0 || s->sequence > slot(latest)->sequence)
+			latest = i;
+	}
+	return latest;
+}
+
+/*! \returns The slot with the given index, 0 or 1 */
+CheckpointFile::Slot* CheckpointFile::slot(size_t index) const
+{
+	return reinterpret_cast<Slot*>(static_cast<char*>(m_map) + SLOT_OFFSET + index * slotSize());
+}
+
+/*! \returns The size of a slot in bytes */
+size_t CheckpointFile::slotSize() const
+{
+	return sizeof(Slot) + m_maxDevices * sizeof(DeviceCheckpoint);
+}
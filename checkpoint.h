@@ -0,0 +1,61 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "errorstatefilter.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*! \brief Integration state of one device as stored in a checkpoint */
+struct DeviceCheckpoint
+{
+	char bluetoothAddress[18] = {};
+	uint8_t headingResetDone = 0;
+	uint8_t reserved[5] = {};
+	uint32_t lastSampleTimeFine = 0;
+	uint32_t reserved2 = 0;
+	double sampleTime = 0.0;		//!< Time of the last integrated sample in seconds since the epoch, the SampleTimeFine timeline continues from it
+	FilterState state;
+	ErrorStateFilter::Covariance covariance;	//!< Error covariance of \a state as saved, motion while the process was down is not added
+};
+
+/*! \brief Memory-mapped, double-buffered snapshot file of the per-device integration state
+	\details The file holds two slots. A save writes the slot that is not the latest one and
+	publishes it by writing its sequence number last, so the previous snapshot stays intact until
+	the new one is complete. The mapping is shared, so a snapshot survives the process dying at any
+	point; call sync() to also make it survive a power loss. Loading picks the valid slot with the
+	highest sequence number, slots are validated with a CRC.
+*/
+class CheckpointFile
+{
+public:
+	CheckpointFile();
+	~CheckpointFile();
+
+	bool open(const std::string& fileName, size_t maxDevices);
+	void close();
+	bool isOpen() const;
+
+	bool load(std::vector<DeviceCheckpoint>& devices, int64_t& timestamp) const;
+	bool save(const std::vector<DeviceCheckpoint>& devices, int64_t timestamp);
+	bool sync();
+
+private:
+	struct Header;
+	struct Slot;
+
+	int latestValidSlot() const;
+	Slot* slot(size_t index) const;
+	size_t slotSize() const;
+
+	int m_fd;
+	void* m_map;
+	size_t m_mapSize;
+	size_t m_maxDevices;
+	uint64_t m_sequence;
+	int m_latestSlot;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "csvlog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+//! Returns the value of a "Key: value" field in the header line of a logfile
+string headerField(const string& header, const string& key)
+{
+	stringstream fields(header);
+	string field;
+	while (getline(fields, field, ','))
+	{
+		size_t colon = field.find(':');
+		if (colon != string::npos && field.compare(0, colon, key) == 0)
+		{
+			size_t start = field.find_first_not_of(' ', colon + 1);
+			return start == string::npos ? string() : field.substr(start);
+		}
+	}
+	return string();
+}
+
+//! Parses a "2024-01-19 15:12:48.789" timestamp into seconds since the epoch
+double parseStartTime(const string& text)
+{
+	struct tm time = {};
+	double seconds = 0.0;
+	if (sscanf(text.c_str(), "%d-%d-%d %d:%d:%lf", &time.tm_year, &time.tm_mon, &time.tm_mday, &time.tm_hour, &time.tm_min, &seconds) != 6)
+		return 0.0;
+	time.tm_year -= 1900;
+	time.tm_mon -= 1;
+	return static_cast<double>(timegm(&time)) + seconds;
+}
+}
+
+/*! \brief Read a delta quantities logfile
+	\details Rows that do not contain all eight columns, such as the last rows of a session that was
+	interrupted, are skipped. The SampleTimeFine resolution is derived from the OutputRate in the
+	header and the median sample interval, since it depends on the firmware that wrote the file.
+	\param path The path of the logfile
+	\param log Receives the contents of the file
+	\returns False if the file could not be opened or does not have the expected columns
+*/
+bool readLogFile(const string& path, LogFile& log)
+{
+	ifstream file(path);
+	if (!file)
+		return false;
+
+	string header;
+	string columns;
+	if (!getline(file, header) || !getline(file, columns))
+		return false;
+	if (columns.compare(0, 14, "SampleTimeFine") != 0)
+		return false;
+
+	log = LogFile();
+	log.bluetoothAddress = addressFromLogFileName(path);
+	log.deviceTag = headerField(header, "DeviceTag");
+	log.outputRate = atof(headerField(header, "OutputRate").c_str());
+	log.startTime = parseStartTime(headerField(header, "StartTime"));
+
+	string line;
+	while (getline(file, line))
+	{
+		double values[8];
+		const char* p = line.c_str();
+		int count = 0;
+		while (count < 8 && *p)
+		{
+			char* end;
+			values[count] = strtod(p, &end);
+			if (end == p)
+				break;
+			++count;
+			p = (*end == ',') ? end + 1 : end;
+		}
+		if (count < 8)
+			continue;
+
+		LogSample sample;
+		sample.sampleTimeFine = static_cast<uint32_t>(values[0]);
+		sample.dq = { values[1], values[2], values[3], values[4] };
+		sample.dv = { values[5], values[6], values[7] };
+		log.samples.push_back(sample);
+	}
+
+	if (log.samples.size() >= 2 && log.outputRate > 0.0)
+	{
+		vector<uint32_t> intervals;
+		intervals.reserve(log.samples.size() - 1);
+		for (size_t i = 1; i < log.samples.size(); ++i)
+			intervals.push_back(log.samples[i].sampleTimeFine - log.samples[i - 1].sampleTimeFine);
+		nth_element(intervals.begin(), intervals.begin() + intervals.size() / 2, intervals.end());
+		double median = intervals[intervals.size() / 2];
+
+		// Average the regular intervals, the counter may be coarser than the sample period
+		double sum = 0.0;
+		size_t regular = 0;
+		for (uint32_t interval : intervals)
+			if (interval > 0.5 * median && interval < 1.5 * median)
+			{
+				sum += interval;
+				++regular;
+			}
+		log.ticksPerSecond = (regular ? sum / regular : median) * log.outputRate;
+	}
+	return true;
+}
+
+/*! \returns The bluetooth address encoded in a logfile name such as logfile_D4-22-CD-00-62-76.csv,
+	in the D4:22:CD:00:62:76 notation, or an empty string if the name does not follow that pattern
+	\param path The path of the logfile
+*/
+string addressFromLogFileName(const string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	string name = path.substr(slash == string::npos ? 0 : slash + 1);
+	const string prefix = "logfile_";
+	size_t dot = name.rfind('.');
+	if (name.compare(0, prefix.size(), prefix) != 0 || dot == string::npos || dot <= prefix.size())
+		return string();
+
+	string address = name.substr(prefix.size(), dot - prefix.size());
+	replace(address.begin(), address.end(), '-', ':');
+	return address;
+}
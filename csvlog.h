@@ -0,0 +1,32 @@
+#ifndef CSV_LOG_H
+#define CSV_LOG_H
+
+#include "imumath.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*! \brief One row of a delta quantities logfile */
+struct LogSample
+{
+	uint32_t sampleTimeFine = 0;
+	Quat dq;
+	Vec3 dv;
+};
+
+/*! \brief Contents of a logfile_<address>.csv written by XsDotDevice::enableLogging in DeltaQuantities mode */
+struct LogFile
+{
+	std::string bluetoothAddress;
+	std::string deviceTag;
+	double startTime = 0.0;		//!< StartTime of the header, in seconds since the epoch
+	double outputRate = 0.0;
+	double ticksPerSecond = 0.0;
+	std::vector<LogSample> samples;
+};
+
+bool readLogFile(const std::string& path, LogFile& log);
+std::string addressFromLogFileName(const std::string& path);
+
+#endif
@@ -0,0 +1,155 @@
+#include "daemonclient.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*! \brief Constructor */
+DaemonClient::DaemonClient()
+	: m_fd(-1)
+{
+}
+
+/*! \brief Destructor, closes the connection */
+DaemonClient::~DaemonClient()
+{
+	close();
+}
+
+/*! \brief Connect to the daemon
+	\param socketPath The path of the daemon socket
+	\returns False if no daemon is listening on the socket
+*/
+bool DaemonClient::connect(const string& socketPath)
+{
+	close();
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path))
+		return false;
+	strcpy(address.sun_path, socketPath.c_str());
+
+	m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_fd < 0)
+		return false;
+	if (::connect(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+/*! \brief Close the connection, a running session continues */
+void DaemonClient::close()
+{
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+	m_received.clear();
+}
+
+/*! \returns True if connected to a daemon */
+bool DaemonClient::isConnected() const
+{
+	return m_fd >= 0;
+}
+
+/*! \brief Send a command and wait for its reply
+	\param command The command line, without the line end
+	\param reply Receives the reply line, or "ERROR" and the reason if the daemon could not be reached
+	\returns True if the daemon replied with OK
+*/
+bool DaemonClient::request(const string& command, string& reply)
+{
+	if (m_fd < 0)
+	{
+		reply = "ERROR not connected";
+		return false;
+	}
+
+	string line = command + "\n";
+	for (size_t sent = 0; sent < line.size();)
+	{
+		ssize_t result = send(m_fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+		{
+			close();
+			reply = "ERROR connection lost";
+			return false;
+		}
+		sent += static_cast<size_t>(result);
+	}
+
+	size_t end;
+	while ((end = m_received.find('\n')) == string::npos)
+	{
+		char buffer[1024];
+		ssize_t result = recv(m_fd, buffer, sizeof(buffer), 0);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+		{
+			close();
+			reply = "ERROR connection lost";
+			return false;
+		}
+		m_received.append(buffer, static_cast<size_t>(result));
+	}
+
+	reply = m_received.substr(0, end);
+	m_received.erase(0, end + 1);
+	return reply.compare(0, 2, "OK") == 0;
+}
+
+/*! \brief Request the connection and session state */
+bool DaemonClient::status(string& reply)
+{
+	return request("status", reply);
+}
+
+/*! \brief Start a measurement session
+	\param name The session name, the daemon picks one when empty
+*/
+bool DaemonClient::startSession(const string& name, string& reply)
+{
+	return request(name.empty() ? "start" : "start " + name, reply);
+}
+
+/*! \brief Stop the measurement session */
+bool DaemonClient::stopSession(string& reply)
+{
+	return request("stop", reply);
+}
+
+/*! \brief Reset the heading of all devices */
+bool DaemonClient::resetHeading(string& reply)
+{
+	return request("reset-heading", reply);
+}
+
+/*! \brief Start logging the devices to CSV */
+bool DaemonClient::startRecording(string& reply)
+{
+	return request("record-start", reply);
+}
+
+/*! \brief Stop logging the devices to CSV */
+bool DaemonClient::stopRecording(string& reply)
+{
+	return request("record-stop", reply);
+}
+
+/*! \brief Stop the daemon */
+bool DaemonClient::shutdown(string& reply)
+{
+	return request("shutdown", reply);
+}
@@ -0,0 +1,51 @@
+#ifndef DAEMON_CLIENT_H
+#define DAEMON_CLIENT_H
+
+#include <string>
+
+/*	Protocol of the acquisition daemon (dotdaemon): the client sends one command per line over a
+	Unix-domain stream socket and the daemon answers each with one line that starts with "OK" or
+	"ERROR", followed by a message. A daemon in real-time mode adds the scheduling latency of its
+	measuring loop to the replies of status and stop.
+
+	status						Connection and session state
+	start [name]				Start a measurement session, its files go to the new directory <name>
+	stop						Stop the session and complete its files
+	reset-heading				Reset the heading of all devices
+	record-start				Start logging the devices to CSV, in the session directory
+	record-stop					Stop logging to CSV
+	shutdown					Stop the session, disconnect the devices and exit the daemon
+*/
+
+const char* const DEFAULT_DAEMON_SOCKET = "/tmp/movelladot.sock";
+
+/*! \brief Connection to a running acquisition daemon */
+class DaemonClient
+{
+public:
+	DaemonClient();
+	~DaemonClient();
+
+	bool connect(const std::string& socketPath = DEFAULT_DAEMON_SOCKET);
+	void close();
+	bool isConnected() const;
+
+	bool request(const std::string& command, std::string& reply);
+
+	bool status(std::string& reply);
+	bool startSession(const std::string& name, std::string& reply);
+	bool stopSession(std::string& reply);
+	bool resetHeading(std::string& reply);
+	bool startRecording(std::string& reply);
+	bool stopRecording(std::string& reply);
+	bool shutdown(std::string& reply);
+
+private:
+	DaemonClient(const DaemonClient&) = delete;
+	DaemonClient& operator=(const DaemonClient&) = delete;
+
+	int m_fd;
+	std::string m_received;
+};
+
+#endif
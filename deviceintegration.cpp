@@ -0,0 +1,226 @@
+#include "deviceintegration.h"
+
+#include "realtime.h"
+#include "user_settings.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+namespace
+{
+//! Samples per device the packet batch is prepared for in real-time mode
+const size_t PREALLOCATED_SAMPLES = 256;
+
+//! Sample gaps longer than this (seconds) restart the sample clock instead of being integrated
+const double MAX_SAMPLE_GAP = 1.0;
+}
+
+/*! \brief Constructor, the smoother lag comes from the user settings */
+DeviceIntegration::DeviceIntegration()
+	: smoother(max<size_t>(UserSettings().m_smootherLag, 1))
+{
+}
+
+/*! \brief Start the trajectory files of a session, and the smoothed trajectory when a smoother lag is set
+	\details The smoother restarts from the current filter state
+	\param integration The integration state of the device
+	\param logFileName The logfile of the session, the files are stored next to it
+	\param bluetoothAddress The address of the device, stored in the index
+	\param writerSettings How the files are written in the background
+	\param resume Append to the files of a session that was interrupted, instead of starting new ones
+	\returns False if a trajectory file could not be created
+*/
+bool openTrajectories(DeviceIntegration& integration, const string& logFileName, const string& bluetoothAddress,
+	const AsyncWriterSettings& writerSettings, bool resume)
+{
+	bool ok = integration.trajectory.open(logFileName, bluetoothAddress, 1024, writerSettings, resume);
+	integration.smoother.reset(integration.filter.state().navigation);
+	if (UserSettings().m_smootherLag > 0)
+		ok = integration.smoothedTrajectory.open(smoothedLogFileName(logFileName), bluetoothAddress, 1024, writerSettings, resume) && ok;
+	return ok;
+}
+
+/*! \brief Write the poses still in the smoothing window and complete the trajectory files
+	\param integration The integration state of the device
+	\returns False if a file could not be written completely
+*/
+bool closeTrajectories(DeviceIntegration& integration)
+{
+	if (integration.smoothedTrajectory.isOpen())
+	{
+		vector<SmoothedPose> poses;
+		integration.smoother.flush(poses);
+		for (auto const& pose : poses)
+			integration.smoothedTrajectory.append(pose.time, pose.position, pose.attitude);
+	}
+	bool ok = integration.smoothedTrajectory.close();
+	return integration.trajectory.close() && ok;
+}
+
+/*! \returns The logfile name the smoothed trajectory files are named after, e.g. logfile_x_smoothed.csv for logfile_x.csv */
+string smoothedLogFileName(const string& logFileName)
+{
+	size_t dot = logFileName.rfind('.');
+	size_t slash = logFileName.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return logFileName + "_smoothed";
+	return logFileName.substr(0, dot) + "_smoothed" + logFileName.substr(dot);
+}
+
+/*! \brief Propagate the filter of a device with one live sample and append the pose to its trajectory
+	\details Zero velocity updates are applied while the device is at rest. The sample also goes to
+	the fixed-lag smoother, whose pose that leaves the window is appended to the smoothed trajectory.
+	The poses are timed by SampleTimeFine, anchored to the host time of the first sample and again
+	after a gap, so they keep the spacing of the device clock instead of the USB or Bluetooth arrival.
+	\param integration The integration state of the device
+	\param sampleTimeFine The SampleTimeFine of the sample
+	\param ticksPerSecond The rate of the SampleTimeFine counter
+	\param dq The orientation increment of the sample
+	\param dv The velocity increment of the sample
+	\param hostTime The host time the sample arrived at in seconds since the epoch, only used as the anchor
+*/
+void integrateSample(DeviceIntegration& integration, uint32_t sampleTimeFine, double ticksPerSecond, const Quat& dq, const Vec3& dv, double hostTime)
+{
+	// SampleTimeFine wraps around
+	uint32_t ticks = sampleTimeFine - integration.lastSampleTimeFine;
+	double dt = ticks / ticksPerSecond;
+	integration.lastSampleTimeFine = sampleTimeFine;
+	if (!integration.started || dt > MAX_SAMPLE_GAP)
+	{
+		integration.started = true;
+		integration.anchorTime = hostTime;
+		integration.ticksSinceAnchor = 0;
+		return;
+	}
+
+	integration.filter.propagate(dq, dv, dt);
+	if (isStationary(dq, dv, dt))
+		integration.filter.update(ZeroVelocityMeasurement());
+
+	integration.ticksSinceAnchor += ticks;
+	double time = sampleTime(integration, ticksPerSecond);
+	const NavigationState& nav = integration.filter.state().navigation;
+	integration.trajectory.append(time, nav.position, nav.attitude);
+
+	SmoothedPose pose;
+	if (integration.smoothedTrajectory.isOpen() && integration.smoother.addSample(time, dq, dv, dt, pose))
+		integration.smoothedTrajectory.append(pose.time, pose.position, pose.attitude);
+}
+
+/*! \returns The time of the last integrated sample of a device in seconds since the epoch
+	\param integration The integration state of the device
+	\param ticksPerSecond The rate of the SampleTimeFine counter
+*/
+double sampleTime(const DeviceIntegration& integration, double ticksPerSecond)
+{
+	return integration.anchorTime + integration.ticksSinceAnchor / ticksPerSecond;
+}
+
+/*! \brief Integrate all samples of one device in a drained batch, oldest first
+	\details The SampleTimeFine rate is taken from the user settings
+	\param integration The integration state of the device
+	\param batch The drained samples
+	\param device The index of the device in \a batch
+	\param hostTime The host time the batch was drained at in seconds since the epoch, anchors the first sample
+*/
+void integrateBatch(DeviceIntegration& integration, const PacketBatch& batch, size_t device, double hostTime)
+{
+	// Read once, constructing the settings allocates and this runs for every drained batch
+	static const double ticksPerSecond = UserSettings().m_sampleTimeFineTicksPerSecond;
+	size_t end = batch.deviceFirst[device] + batch.deviceCount[device];
+	for (size_t i = batch.deviceFirst[device]; i < end; ++i)
+		if (batch.valid[i])
+			integrateSample(integration, batch.sampleTimeFine[i], ticksPerSecond,
+				{ batch.dqW[i], batch.dqX[i], batch.dqY[i], batch.dqZ[i] }, { batch.dvX[i], batch.dvY[i], batch.dvZ[i] }, hostTime);
+}
+
+/*! \brief Constructor
+	\param mounts The mounts of the devices of the rig
+	\param noise The noise of each device
+	\param rateHz The rate of the virtual IMU
+*/
+RigIntegration::RigIntegration(const vector<SensorMount>& mounts, const vector<FilterNoise>& noise, double rateHz)
+	: resampler(mounts.size(), rateHz, UserSettings().m_sampleTimeFineTicksPerSecond)
+	, virtualImu(mounts, noise)
+	, period(1.0 / rateHz)
+{
+	for (size_t i = 0; i < mounts.size(); ++i)
+		devices[XsString(mounts[i].bluetoothAddress)] = i;
+	integration.filter.setNoise(virtualImu.fusedNoise());
+	integration.filter.reset();
+}
+
+/*! \brief Pass the samples of one device in a drained batch to the rig, if the device belongs to it
+	\param rig The rig
+	\param batch The drained samples
+	\param device The index of the device in \a batch
+	\param hostTimeMs The host time at which the samples arrived
+	\returns False if the device is not part of the rig, its samples should be integrated on their own
+*/
+bool addBatchToRig(RigIntegration& rig, const PacketBatch& batch, size_t device, int64_t hostTimeMs)
+{
+	auto match = rig.devices.find(batch.bluetoothAddress[device]);
+	if (match == rig.devices.end())
+		return false;
+
+	size_t end = batch.deviceFirst[device] + batch.deviceCount[device];
+	for (size_t i = batch.deviceFirst[device]; i < end; ++i)
+		if (batch.valid[i])
+			rig.resampler.addSample(match->second, batch.sampleTimeFine[i], hostTimeMs,
+				{ batch.dqW[i], batch.dqX[i], batch.dqY[i], batch.dqZ[i] }, { batch.dvX[i], batch.dvY[i], batch.dvZ[i] });
+	return true;
+}
+
+/*! \brief Fuse and integrate every frame of the rig that all its devices have delivered
+	\param rig The rig
+	\param hostTimeMs The current host time
+*/
+void integrateRig(RigIntegration& rig, int64_t hostTimeMs)
+{
+	VirtualImuSample sample;
+	while (rig.resampler.nextFrame(rig.frame, hostTimeMs))
+	{
+		if (!rig.virtualImu.fuse(rig.frame, rig.period, sample))
+			continue;
+		++rig.fusedSamples;
+		if (sample.rejectedAngles || sample.rejectedVelocities)
+			++rig.rejectedSamples;
+
+		// The timeline is in host time, the filter takes its steps and the poses their times from a microsecond counter made from it
+		integrateSample(rig.integration, static_cast<uint32_t>(static_cast<int64_t>(rig.frame.hostTimeMs * 1000.0)), RigIntegration::ticksPerSecond,
+			sample.dq, sample.dv, rig.frame.hostTimeMs / 1000.0);
+	}
+}
+
+/*! \returns The writer settings for trajectory files from the user settings
+	\param realtime True to pin the writer threads and give them their real-time priority
+*/
+AsyncWriterSettings trajectoryWriterSettings(bool realtime)
+{
+	AsyncWriterSettings settings;
+	settings.directIo = UserSettings().m_trajectoryDirectIo;
+	settings.syncPolicy = UserSettings().m_trajectorySyncPolicy;
+	if (realtime)
+	{
+		settings.cpus = parseCpuList(UserSettings().m_realtimeWorkerCpus.toStdString());
+		settings.fifoPriority = UserSettings().m_realtimeWorkerPriority;
+	}
+	return settings;
+}
+
+/*! \brief Lock and prefault memory, pin the calling packet loop thread and raise its priority
+	\details Call after the devices are connected and the writers are started, threads created
+	later inherit the scheduling of the packet loop. Steps that are not permitted are skipped.
+	\param batch The packet batch of the loop, its arrays are allocated up front
+	\param devices The number of connected devices
+*/
+void enterRealtimeMode(PacketBatch& batch, size_t devices)
+{
+	bool locked = lockProcessMemory(UserSettings().m_realtimePrefaultBytes, 256 * 1024);
+	batch.reserve(devices, devices * PREALLOCATED_SAMPLES);
+	bool scheduled = setThreadRealtime("packet loop", parseCpuList(UserSettings().m_realtimeConsumerCpus.toStdString()), UserSettings().m_realtimeConsumerPriority);
+	cout << "Real-time mode: memory " << (locked ? "locked" : "not locked") << ", packet loop "
+		<< (scheduled ? "pinned and prioritized" : "partly or not pinned/prioritized") << endl;
+}
@@ -0,0 +1,58 @@
+#ifndef DEVICE_INTEGRATION_H
+#define DEVICE_INTEGRATION_H
+
+#include "errorstatefilter.h"
+#include "trajectoryindex.h"
+#include "trajectorysmoother.h"
+#include "virtualimu.h"
+#include "xdpchandler.h"
+
+#include <map>
+
+/*! \brief Integration state of a connected device */
+struct DeviceIntegration
+{
+	DeviceIntegration();
+
+	ErrorStateFilter filter;
+	TrajectorySmoother smoother;
+	SessionIndexWriter trajectory;
+	SessionIndexWriter smoothedTrajectory;		//!< Poses of the fixed-lag smoother, written lag samples behind
+	uint32_t lastSampleTimeFine = 0;
+	double anchorTime = 0.0;			//!< Host time of the sample the SampleTimeFine timeline starts at, in seconds since the epoch
+	int64_t ticksSinceAnchor = 0;		//!< SampleTimeFine ticks from the anchor to the last sample
+	bool started = false;
+};
+
+/*! \brief Integration state of a rig of rigidly mounted devices, integrated once as a virtual IMU */
+struct RigIntegration
+{
+	RigIntegration(const std::vector<SensorMount>& mounts, const std::vector<FilterNoise>& noise, double rateHz);
+
+	static constexpr double ticksPerSecond = 1e6;	//!< Rate of the counter made from host time that the rig is integrated with
+
+	std::map<XsString, size_t> devices;	//!< Index of each device of the rig by bluetooth address
+	TimelineResampler resampler;
+	VirtualImu virtualImu;
+	DeviceIntegration integration;
+	ResampledFrame frame;
+	double period;
+	size_t fusedSamples = 0;
+	size_t rejectedSamples = 0;
+};
+
+bool openTrajectories(DeviceIntegration& integration, const std::string& logFileName, const std::string& bluetoothAddress,
+	const AsyncWriterSettings& writerSettings, bool resume = false);
+bool closeTrajectories(DeviceIntegration& integration);
+std::string smoothedLogFileName(const std::string& logFileName);
+
+void integrateSample(DeviceIntegration& integration, uint32_t sampleTimeFine, double ticksPerSecond, const Quat& dq, const Vec3& dv, double hostTime);
+double sampleTime(const DeviceIntegration& integration, double ticksPerSecond);
+void integrateBatch(DeviceIntegration& integration, const PacketBatch& batch, size_t device, double hostTime);
+bool addBatchToRig(RigIntegration& rig, const PacketBatch& batch, size_t device, int64_t hostTimeMs);
+void integrateRig(RigIntegration& rig, int64_t hostTimeMs);
+
+AsyncWriterSettings trajectoryWriterSettings(bool realtime);
+void enterRealtimeMode(PacketBatch& batch, size_t devices);
+
+#endif
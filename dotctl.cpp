@@ -0,0 +1,55 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include "daemonclient.h"
+
+using namespace std;
+
+void printUsage()
+{
+	cout << "Usage: dotctl [--socket <path>] <command> [argument]" << endl;
+	cout << "Sends a command to a running dotdaemon and prints its reply. Commands:" << endl;
+	cout << "  status                 Connection and session state" << endl;
+	cout << "  start [name]           Start a measurement session, its files go to the new directory <name>" << endl;
+	cout << "  stop                   Stop the session" << endl;
+	cout << "  reset-heading          Reset the heading of all devices" << endl;
+	cout << "  record-start           Log the devices to CSV, from now or from the next session" << endl;
+	cout << "  record-stop            Stop logging to CSV" << endl;
+	cout << "  shutdown               Stop the daemon and disconnect the devices" << endl;
+}
+
+//--------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	string socketPath = DEFAULT_DAEMON_SOCKET;
+	int first = 1;
+	if (argc > 2 && string(argv[1]) == "--socket")
+	{
+		socketPath = argv[2];
+		first = 3;
+	}
+	if (first >= argc || string(argv[first]) == "-h" || string(argv[first]) == "--help")
+	{
+		printUsage();
+		return first >= argc ? -1 : 0;
+	}
+
+	string command = argv[first];
+	for (int i = first + 1; i < argc; ++i)
+		command += string(" ") + argv[i];
+
+	DaemonClient client;
+	if (!client.connect(socketPath))
+	{
+		cout << "No daemon is listening on " << socketPath << ", start dotdaemon first." << endl;
+		return -1;
+	}
+
+	auto start = chrono::steady_clock::now();
+	string reply;
+	bool ok = client.request(command, reply);
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+	cout << reply << " (" << elapsed << " ms round trip)" << endl;
+	return ok ? 0 : -1;
+}
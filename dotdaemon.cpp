@@ -0,0 +1,463 @@
+#include <iostream>
+#include <iomanip>
+#include <csignal>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "xdpchandler.h"
+#include "user_settings.h"
+#include "daemonclient.h"
+#include "deviceintegration.h"
+#include "noiseparameters.h"
+#include "realtime.h"
+#include "tracing.h"
+
+using namespace std;
+
+/*	Acquisition daemon: connects to the Movella DOT devices once and keeps the connection manager
+	and the connections alive between measurement sessions, which clients start and stop over a
+	Unix-domain socket (see daemonclient.h for the protocol, dotctl for a command line client).
+*/
+
+XdpcHandler xdpcHandler;
+map<XsString, DeviceIntegration> integrations;
+map<string, FilterNoise> noiseParameters;
+bool realtimeMode = UserSettings().m_realtime;
+
+// Session state
+bool measuring = false;
+bool recording = false;		// Requested by the client, applies to the current and later sessions
+bool headingReset = false;
+string sessionName;
+int sessionCount = 0;
+int64_t sessionStart = 0;
+uint64_t sessionSamples = 0;
+unique_ptr<CycleTimer> cycleTimer;		// Paces the measuring loop in real-time mode, restarted every session
+
+volatile sig_atomic_t isRunning = true;
+
+void signalHandler(int signum)
+{
+	if (signum == SIGINT || signum == SIGTERM)
+		isRunning = false;
+}
+
+struct Client
+{
+	int fd;
+	string received;
+};
+
+//! The logfile of a device in the directory of a session
+XsString sessionLogFileName(const string& session, XsDotDevice* device)
+{
+	return XsString(session.c_str()) << "/logfile_" << device->bluetoothAddress().replacedAll(":", "-") << ".csv";
+}
+
+/*-------------------------------------------------
+				DEVICES
+-------------------------------------------------*/
+bool connectDevices()
+{
+	TRACE_SPAN("dotdaemon::connectDevices");
+	if (!xdpcHandler.initialize())
+		return false;
+
+	xdpcHandler.scanForDots();
+	if (xdpcHandler.detectedDots().empty())
+	{
+		cout << "No Movella DOT device(s) found. Aborting." << endl;
+		xdpcHandler.cleanup();
+		return false;
+	}
+
+	xdpcHandler.connectDots();
+	if (xdpcHandler.connectedDots().empty())
+	{
+		cout << "Could not connect to any Movella DOT device(s). Aborting." << endl;
+		xdpcHandler.cleanup();
+		return false;
+	}
+
+	// Settings that do not change between sessions are applied once
+	for (auto& device : xdpcHandler.connectedDots())
+	{
+		if (!device->setOnboardFilterProfile(XsString("General")))
+			cout << "Setting filter profile of " << device->bluetoothAddress() << " failed!" << endl;
+		device->setLogOptions(XsLogOptions::Quaternion);
+	}
+
+	if (!loadNoiseParameters(UserSettings().m_noiseParameterFileName.toStdString(), noiseParameters))
+		cout << "No noise parameter file " << UserSettings().m_noiseParameterFileName << ", using the default filter noise settings." << endl;
+	return true;
+}
+
+/*-------------------------------------------------
+				COMMANDS
+-------------------------------------------------*/
+//! Returns the number of devices for which logging could not be enabled
+size_t enableLogging()
+{
+	size_t failed = 0;
+	for (auto& device : xdpcHandler.connectedDots())
+	{
+		if (!device->enableLogging(sessionLogFileName(sessionName, device)))
+		{
+			cout << "Failed to enable logging for " << device->bluetoothAddress() << ". Reason: " << device->lastResultText() << endl;
+			++failed;
+		}
+	}
+	return failed;
+}
+
+void disableLogging()
+{
+	for (auto& device : xdpcHandler.connectedDots())
+		if (!device->disableLogging())
+			cout << "Failed to disable logging for " << device->bluetoothAddress() << endl;
+}
+
+string startRecording()
+{
+	if (recording)
+		return "OK already recording";
+
+	recording = true;
+	if (!measuring)
+		return "OK the next session will be recorded";
+
+	size_t failed = enableLogging();
+	return failed ? "ERROR logging failed for " + to_string(failed) + " device(s)" : "OK recording to " + sessionName;
+}
+
+string stopRecording()
+{
+	if (!recording)
+		return "OK not recording";
+
+	recording = false;
+	if (measuring)
+		disableLogging();
+	return "OK recording stopped";
+}
+
+string startSession(const string& name)
+{
+	TRACE_SPAN("dotdaemon::startSession");
+	if (measuring)
+		return "ERROR session " + sessionName + " is running";
+
+	// The name is a directory below the working directory, an existing session is never overwritten
+	if (name.find('/') != string::npos || name.find("..") != string::npos)
+		return "ERROR invalid session name " + name;
+
+	int64_t start = XsTime::timeStampNow();
+	string directory = name;
+	int result;
+	do
+	{
+		if (name.empty())
+			directory = "session_" + to_string(++sessionCount);
+		result = mkdir(directory.c_str(), 0755);
+	} while (result != 0 && errno == EEXIST && name.empty());
+	if (result != 0)
+		return errno == EEXIST ? "ERROR session " + directory + " already exists" : "ERROR could not create directory " + directory;
+	sessionName = directory;
+
+	if (recording && enableLogging())
+		cout << "Session " << sessionName << " is not recorded completely" << endl;
+
+	// Discard anything still buffered from before, before the devices start sending the new session
+	PacketBatch stale;
+	xdpcHandler.drainPackets(stale);
+
+	// Every session starts from a fresh filter at the origin
+	size_t started = 0;
+	for (auto& device : xdpcHandler.connectedDots())
+	{
+		DeviceIntegration& integration = integrations[device->bluetoothAddress()];
+		auto noise = noiseParameters.find(device->bluetoothAddress().toStdString());
+		integration.filter.setNoise(noise == noiseParameters.end() ? FilterNoise() : noise->second);
+		integration.filter.reset();
+		integration.started = false;
+
+		XsString logFileName = sessionLogFileName(sessionName, device);
+		if (!openTrajectories(integration, logFileName.toStdString(), device->bluetoothAddress().toStdString(), trajectoryWriterSettings(realtimeMode)))
+			cout << "Failed to create the trajectory file for " << logFileName << endl;
+
+		if (device->startMeasurement(XsPayloadMode::DeltaQuantities))
+			++started;
+		else
+			cout << "Could not put " << device->bluetoothAddress() << " into measurement mode. Reason: " << device->lastResultText() << endl;
+	}
+
+	measuring = true;
+	headingReset = false;
+	sessionStart = XsTime::timeStampNow();
+	sessionSamples = 0;
+	if (realtimeMode)
+		cycleTimer.reset(new CycleTimer(UserSettings().m_realtimePeriodUs));
+
+	stringstream reply;
+	reply << (started ? "OK" : "ERROR") << " session " << sessionName << " started on " << started << " of "
+		<< xdpcHandler.connectedDots().size() << " device(s) in " << sessionStart - start << " ms";
+	return reply.str();
+}
+
+string stopSession()
+{
+	TRACE_SPAN("dotdaemon::stopSession");
+	if (!measuring)
+		return "ERROR no session running";
+
+	int64_t start = XsTime::timeStampNow();
+	if (recording)
+		disableLogging();
+	for (auto& device : xdpcHandler.connectedDots())
+	{
+		if (headingReset && !device->resetOrientation(XRM_DefaultAlignment))
+			cout << "Failed to reset the heading of " << device->bluetoothAddress() << " to default" << endl;
+		if (!device->stopMeasurement())
+			cout << "Failed to stop measurement of " << device->bluetoothAddress() << endl;
+	}
+	for (auto& integration : integrations)
+		closeTrajectories(integration.second);
+	measuring = false;
+
+	stringstream reply;
+	reply << "OK session " << sessionName << " stopped in " << XsTime::timeStampNow() - start << " ms, "
+		<< sessionSamples << " samples in " << (start - sessionStart) / 1000.0 << " s";
+	if (cycleTimer)
+		reply << ", " << cycleTimer->report();
+	return reply.str();
+}
+
+string resetHeading()
+{
+	if (!measuring)
+		return "ERROR no session running";
+
+	size_t failed = 0;
+	for (auto const& device : xdpcHandler.connectedDots())
+	{
+		if (device->resetOrientation(XRM_Heading))
+			integrations[device->bluetoothAddress()].filter.update(HeadingMeasurement());
+		else
+		{
+			cout << "Resetting heading for " << device->bluetoothAddress() << " failed: " << device->lastResultText() << endl;
+			++failed;
+		}
+	}
+	headingReset = true;
+	return failed ? "ERROR heading reset failed for " + to_string(failed) + " device(s)" : "OK heading reset";
+}
+
+string status()
+{
+	stringstream reply;
+	reply << "OK devices=" << xdpcHandler.connectedDots().size()
+		<< " state=" << (measuring ? "measuring" : "idle");
+	if (measuring)
+		reply << " session=" << sessionName << " recording=" << (recording ? "yes" : "no")
+			<< " seconds=" << (XsTime::timeStampNow() - sessionStart) / 1000.0 << " samples=" << sessionSamples;
+	reply << " dropped=" << xdpcHandler.packetsDropped();
+	if (measuring && cycleTimer)
+		reply << ", " << cycleTimer->report();
+	return reply.str();
+}
+
+string handleCommand(const string& line)
+{
+	stringstream words(line);
+	string command, argument;
+	words >> command >> argument;
+
+	if (command == "status")
+		return status();
+	if (command == "start")
+		return startSession(argument);
+	if (command == "stop")
+		return stopSession();
+	if (command == "reset-heading")
+		return resetHeading();
+	if (command == "record-start")
+		return startRecording();
+	if (command == "record-stop")
+		return stopRecording();
+	if (command == "shutdown")
+	{
+		isRunning = false;
+		return "OK shutting down";
+	}
+	return "ERROR unknown command " + command;
+}
+
+/*-------------------------------------------------
+				SOCKET
+-------------------------------------------------*/
+int openListenSocket(const string& path)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return -1;
+	strcpy(address.sun_path, path.c_str());
+
+	// A socket file that nobody answers on is left over from a daemon that did not exit cleanly
+	DaemonClient probe;
+	if (probe.connect(path))
+	{
+		cout << "Another daemon is already listening on " << path << endl;
+		return -1;
+	}
+	unlink(path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 8) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//! Reads the pending input of a client and answers its complete lines, returns false when it disconnected
+bool serveClient(Client& client)
+{
+	char buffer[1024];
+	ssize_t result = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (result < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (result == 0)
+		return false;
+	client.received.append(buffer, static_cast<size_t>(result));
+
+	size_t end;
+	while ((end = client.received.find('\n')) != string::npos)
+	{
+		string line = client.received.substr(0, end);
+		client.received.erase(0, end + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		cout << "> " << line << endl;
+		string reply = handleCommand(line);
+		cout << "< " << reply << endl;
+
+		// Replies are short, a client that does not read them is dropped
+		reply += "\n";
+		if (send(client.fd, reply.data(), reply.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != static_cast<ssize_t>(reply.size()))
+			return false;
+	}
+	return client.received.size() < 4096;
+}
+
+//--------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	string socketPath = DEFAULT_DAEMON_SOCKET;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (string(argv[i]) == "--socket" && i + 1 < argc)
+			socketPath = argv[++i];
+		else if (string(argv[i]) == "--realtime")
+			realtimeMode = true;
+		else
+		{
+			cout << "Usage: dotdaemon [--socket <path>] [--realtime]" << endl;
+			cout << "Connects to the Movella DOT devices once and serves measurement sessions to dotctl clients." << endl;
+			return -1;
+		}
+	}
+
+	signal(SIGINT, signalHandler);
+	signal(SIGTERM, signalHandler);
+
+	int listenFd = openListenSocket(socketPath);
+	if (listenFd < 0)
+	{
+		cout << "Could not listen on " << socketPath << endl;
+		return -1;
+	}
+	if (!connectDevices())
+	{
+		close(listenFd);
+		unlink(socketPath.c_str());
+		return -1;
+	}
+	cout << "Connected to " << xdpcHandler.connectedDots().size() << " device(s), listening on " << socketPath << endl;
+
+	vector<Client> clients;
+	vector<pollfd> fds;
+	PacketBatch batch;
+	if (realtimeMode)
+		enterRealtimeMode(batch, xdpcHandler.connectedDots().size());
+	while (isRunning)
+	{
+		fds.clear();
+		fds.push_back({ listenFd, POLLIN, 0 });
+		for (auto const& client : clients)
+			fds.push_back({ client.fd, POLLIN, 0 });
+
+		// While measuring the loop also drains the packet buffers, so it only briefly waits for commands.
+		// In real-time mode it does not wait at all, the cycle timer paces it.
+		bool paced = measuring && cycleTimer;
+		int result = poll(fds.data(), fds.size(), paced ? 0 : (measuring ? 1 : 100));
+		if (result < 0 && errno != EINTR)
+			break;
+
+		if (result > 0 && (fds[0].revents & POLLIN))
+		{
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd >= 0)
+				clients.push_back({ fd, string() });
+		}
+		for (size_t i = 1; result > 0 && i < fds.size(); ++i)
+		{
+			if (!fds[i].revents)
+				continue;
+			Client& client = clients[i - 1];
+			if (!serveClient(client))
+			{
+				close(client.fd);
+				client.fd = -1;
+			}
+		}
+		clients.erase(remove_if(clients.begin(), clients.end(), [](const Client& c) { return c.fd < 0; }), clients.end());
+
+		if (measuring && xdpcHandler.drainPackets(batch))
+		{
+			TRACE_SPAN("dotdaemon::integrate");
+			double now = XsTime::timeStampNow() / 1000.0;
+			for (size_t d = 0; d < batch.devices(); ++d)
+				integrateBatch(integrations[batch.bluetoothAddress[d]], batch, d, now);
+			sessionSamples += batch.samples();
+		}
+		if (measuring && cycleTimer)
+			cycleTimer->wait();
+	}
+
+	if (measuring)
+		cout << stopSession() << endl;
+	for (auto const& client : clients)
+		close(client.fd);
+	close(listenFd);
+	unlink(socketPath.c_str());
+
+	xdpcHandler.cleanup();
+	TRACE_FLUSH(UserSettings().m_traceFileName.c_str());
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include "errorstatefilter.h"
+
+using namespace std;
+
+namespace
+{
+typedef Matrix<3, 3> Mat3;
+
+Mat3 rotationMatrix(const Quat& q)
+{
+	Mat3 r;
+	r(0, 0) = 1.0 - 2.0 * (q.y * q.y + q.z * q.z);
+	r(0, 1) = 2.0 * (q.x * q.y - q.w * q.z);
+	r(0, 2) = 2.0 * (q.x * q.z + q.w * q.y);
+	r(1, 0) = 2.0 * (q.x * q.y + q.w * q.z);
+	r(1, 1) = 1.0 - 2.0 * (q.x * q.x + q.z * q.z);
+	r(1, 2) = 2.0 * (q.y * q.z - q.w * q.x);
+	r(2, 0) = 2.0 * (q.x * q.z - q.w * q.y);
+	r(2, 1) = 2.0 * (q.y * q.z + q.w * q.x);
+	r(2, 2) = 1.0 - 2.0 * (q.x * q.x + q.y * q.y);
+	return r;
+}
+
+Mat3 skew(const Vec3& v)
+{
+	Mat3 s;
+	s(0, 1) = -v.z;
+	s(0, 2) = v.y;
+	s(1, 0) = v.z;
+	s(1, 2) = -v.x;
+	s(2, 0) = -v.y;
+	s(2, 1) = v.x;
+	return s;
+}
+
+//! Covariance block (i, j), where the blocks are the five 3-vectors of the error state
+Mat3 block(const ErrorStateFilter::Covariance& p, int i, int j)
+{
+	return p.block<3, 3>(3 * i, 3 * j);
+}
+}
+
+/*! \brief Constructor
+	\param noise The process noise and initial uncertainties of the filter
+*/
+ErrorStateFilter::ErrorStateFilter(const FilterNoise& noise)
+	: m_noise(noise)
+{
+	reset();
+}
+
+/*! \brief Restart the filter from \a state with the initial uncertainties of the noise settings
+	\details Position and velocity start without uncertainty, they define the origin of the track.
+*/
+void ErrorStateFilter::reset(const FilterState& state)
+{
+	m_state = state;
+	m_p = Covariance();
+	for (int i = 0; i < 3; ++i)
+	{
+		m_p(Attitude + i, Attitude + i) = m_noise.initialAttitudeStd * m_noise.initialAttitudeStd;
+		m_p(GyroBias + i, GyroBias + i) = m_noise.initialGyroBiasStd * m_noise.initialGyroBiasStd;
+		m_p(AccelerationBias + i, AccelerationBias + i) = m_noise.initialAccelerationBiasStd * m_noise.initialAccelerationBiasStd;
+	}
+}
+
+/*! \brief Continue from a saved state and its error covariance, such as a checkpoint
+	\param state The nominal state
+	\param covariance The error covariance that belongs to \a state
+*/
+void ErrorStateFilter::restore(const FilterState& state, const Covariance& covariance)
+{
+	m_state = state;
+	m_p = covariance;
+}
+
+/*! \brief Propagate the nominal state and the error covariance with one delta quantities sample
+	\details The error transition is F = I + G where G only has the attitude/gyro bias,
+	velocity/attitude, velocity/accelerometer bias and position/velocity blocks. The covariance is
+	therefore updated as P + GP + (GP)^T + GPG^T, computing only the non-zero 3x3 blocks of the
+	upper triangle and mirroring them, instead of two dense 15x15 products.
+	\param dq The orientation increment of the sample
+	\param dv The velocity increment of the sample, in the sensor frame
+	\param dt The sample interval in seconds
+*/
+void ErrorStateFilter::propagate(const Quat& dq, const Vec3& dv, double dt)
+{
+	// Remove the estimated biases and integrate the nominal state
+	Quat dqCorrected = quatMultiply(dq, quatFromRotationVector(m_state.gyroBias * -dt));
+	Vec3 dvCorrected = dv - m_state.accelerationBias * dt;
+
+	Mat3 r = rotationMatrix(m_state.navigation.attitude);
+	Vec3 dvNav = quatRotate(m_state.navigation.attitude, dvCorrected);
+
+	StrapdownIntegrator integrator;
+	integrator.reset(m_state.navigation);
+	integrator.propagate(dqCorrected, dvCorrected, dt);
+	m_state.navigation = integrator.state();
+
+	// Non-zero blocks of G, block indices 0..4 are attitude, velocity, position, gyro bias, acc bias
+	Mat3 biasToNav = r * -dt;
+	Mat3 attitudeToVelocity = skew(dvNav) * -1.0;
+
+	// A = G * P, only the attitude, velocity and position block rows are non-zero
+	Mat3 a[3][5];
+	for (int j = 0; j < 5; ++j)
+	{
+		a[0][j] = biasToNav * block(m_p, 3, j);
+		a[1][j] = attitudeToVelocity * block(m_p, 0, j) + biasToNav * block(m_p, 4, j);
+		a[2][j] = block(m_p, 1, j) * dt;
+	}
+
+	// B = A * G^T, only the upper left 3x3 blocks are non-zero
+	Mat3 biasToNavT = biasToNav.transposed();
+	Mat3 attitudeToVelocityT = attitudeToVelocity.transposed();
+	Mat3 b[3][3];
+	for (int i = 0; i < 3; ++i)
+	{
+		b[i][0] = a[i][3] * biasToNavT;
+		b[i][1] = a[i][0] * attitudeToVelocityT + a[i][4] * biasToNavT;
+		b[i][2] = a[i][1] * dt;
+	}
+
+	Covariance p = m_p;
+	for (int i = 0; i < 5; ++i)
+		for (int j = i; j < 5; ++j)
+		{
+			if (i >= 3 && j >= 3)
+				continue;
+			Mat3 sum = block(m_p, i, j);
+			if (i < 3)
+				sum += a[i][j];
+			if (j < 3)
+				sum += a[j][i].transposed();
+			if (i < 3 && j < 3)
+				sum += b[i][j];
+			p.setBlock(3 * i, 3 * j, sum);
+		}
+
+	double qGyro = m_noise.gyroNoise * m_noise.gyroNoise * dt;
+	double qAcc = m_noise.accelerationNoise * m_noise.accelerationNoise * dt;
+	double qGyroBias = m_noise.gyroBiasRandomWalk * m_noise.gyroBiasRandomWalk * dt;
+	double qAccBias = m_noise.accelerationBiasRandomWalk * m_noise.accelerationBiasRandomWalk * dt;
+	for (int i = 0; i < 3; ++i)
+	{
+		p(Attitude + i, Attitude + i) += qGyro;
+		p(Velocity + i, Velocity + i) += qAcc;
+		p(Position + i, Position + i) += qAcc * dt * dt / 3.0;
+		p(GyroBias + i, GyroBias + i) += qGyroBias;
+		p(AccelerationBias + i, AccelerationBias + i) += qAccBias;
+	}
+
+	symmetrize(p);
+	m_p = p;
+}
+
+/*! \returns The current nominal state */
+const FilterState& ErrorStateFilter::state() const
+{
+	return m_state;
+}
+
+/*! \returns The current error state covariance */
+const ErrorStateFilter::Covariance& ErrorStateFilter::covariance() const
+{
+	return m_p;
+}
+
+/*! \returns The process noise settings */
+const FilterNoise& ErrorStateFilter::noise() const
+{
+	return m_noise;
+}
+
+/*! \brief Replace the process noise settings, the current covariance is kept */
+void ErrorStateFilter::setNoise(const FilterNoise& noise)
+{
+	m_noise = noise;
+}
+
+/*! \brief Fold an estimated error state into the nominal state */
+void ErrorStateFilter::inject(const Matrix<StateDim, 1>& dx)
+{
+	Vec3 dTheta = { dx(Attitude, 0), dx(Attitude + 1, 0), dx(Attitude + 2, 0) };
+	NavigationState& nav = m_state.navigation;
+	nav.attitude = quatNormalized(quatMultiply(quatFromRotationVector(dTheta), nav.attitude));
+	nav.velocity = nav.velocity + Vec3 { dx(Velocity, 0), dx(Velocity + 1, 0), dx(Velocity + 2, 0) };
+	nav.position = nav.position + Vec3 { dx(Position, 0), dx(Position + 1, 0), dx(Position + 2, 0) };
+	m_state.gyroBias = m_state.gyroBias + Vec3 { dx(GyroBias, 0), dx(GyroBias + 1, 0), dx(GyroBias + 2, 0) };
+	m_state.accelerationBias = m_state.accelerationBias + Vec3 { dx(AccelerationBias, 0), dx(AccelerationBias + 1, 0), dx(AccelerationBias + 2, 0) };
+}
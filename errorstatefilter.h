@@ -0,0 +1,162 @@
+#ifndef ERROR_STATE_FILTER_H
+#define ERROR_STATE_FILTER_H
+
+#include "fixedmatrix.h"
+#include "strapdown.h"
+
+#include <cmath>
+
+/*! \brief Nominal state of the error-state filter */
+struct FilterState
+{
+	NavigationState navigation;
+	Vec3 gyroBias;			//!< Gyroscope bias in rad/s
+	Vec3 accelerationBias;	//!< Accelerometer bias in m/s^2
+};
+
+struct FilterNoise
+{
+	double gyroNoise = 1e-3;					//!< Angle random walk in rad/s/sqrt(Hz)
+	double accelerationNoise = 1e-2;			//!< Velocity random walk in m/s^2/sqrt(Hz)
+	double gyroBiasRandomWalk = 1e-5;			//!< Gyroscope bias drift in rad/s^2/sqrt(Hz)
+	double accelerationBiasRandomWalk = 1e-4;	//!< Accelerometer bias drift in m/s^3/sqrt(Hz)
+	double initialAttitudeStd = 0.05;			//!< Initial attitude uncertainty in rad
+	double initialGyroBiasStd = 0.01;			//!< Initial gyroscope bias uncertainty in rad/s
+	double initialAccelerationBiasStd = 0.1;	//!< Initial accelerometer bias uncertainty in m/s^2
+};
+
+/*! \brief Error-state Kalman filter for attitude, velocity, position and IMU biases of one device
+	\details The error state is ordered as attitude (navigation frame small angles), velocity,
+	position, gyroscope bias and accelerometer bias, each a 3-vector. All dimensions are compile-time
+	constants so a filter lives entirely in its object, without heap allocations. Measurement updates
+	are pluggable: any type providing a compile-time \c Dim, \c residual(), \c jacobian() and
+	\c covariance() can be passed to update().
+*/
+class ErrorStateFilter
+{
+public:
+	static constexpr int StateDim = 15;
+	static constexpr int Attitude = 0;
+	static constexpr int Velocity = 3;
+	static constexpr int Position = 6;
+	static constexpr int GyroBias = 9;
+	static constexpr int AccelerationBias = 12;
+
+	typedef Matrix<StateDim, StateDim> Covariance;
+
+	explicit ErrorStateFilter(const FilterNoise& noise = FilterNoise());
+
+	void reset(const FilterState& state = FilterState());
+	void restore(const FilterState& state, const Covariance& covariance);
+	void propagate(const Quat& dq, const Vec3& dv, double dt);
+
+	template <class Measurement>
+	bool update(const Measurement& measurement);
+
+	const FilterState& state() const;
+	const Covariance& covariance() const;
+	const FilterNoise& noise() const;
+	void setNoise(const FilterNoise& noise);
+
+private:
+	void inject(const Matrix<StateDim, 1>& dx);
+
+	FilterNoise m_noise;
+	FilterState m_state;
+	Covariance m_p;
+};
+
+/*! \brief Zero velocity update, for samples at which the device is known to be at rest */
+struct ZeroVelocityMeasurement
+{
+	static constexpr int Dim = 3;
+	double noise = 0.02;	//!< Standard deviation of the observation in m/s
+
+	Matrix<Dim, 1> residual(const FilterState& state) const
+	{
+		Matrix<Dim, 1> r;
+		r(0, 0) = -state.navigation.velocity.x;
+		r(1, 0) = -state.navigation.velocity.y;
+		r(2, 0) = -state.navigation.velocity.z;
+		return r;
+	}
+
+	Matrix<Dim, ErrorStateFilter::StateDim> jacobian(const FilterState&) const
+	{
+		Matrix<Dim, ErrorStateFilter::StateDim> h;
+		for (int i = 0; i < Dim; ++i)
+			h(i, ErrorStateFilter::Velocity + i) = 1.0;
+		return h;
+	}
+
+	Matrix<Dim, Dim> covariance() const
+	{
+		return Matrix<Dim, Dim>::identity() * (noise * noise);
+	}
+};
+
+/*! \brief Heading observation, the filter counterpart of resetOrientation(XRM_Heading) on the device */
+struct HeadingMeasurement
+{
+	static constexpr int Dim = 1;
+	double heading = 0.0;	//!< Observed heading in rad
+	double noise = 0.01;	//!< Standard deviation of the observation in rad
+
+	Matrix<Dim, 1> residual(const FilterState& state) const
+	{
+		Matrix<Dim, 1> r;
+		r(0, 0) = std::remainder(heading - quatYaw(state.navigation.attitude), 2.0 * M_PI);
+		return r;
+	}
+
+	Matrix<Dim, ErrorStateFilter::StateDim> jacobian(const FilterState& state) const
+	{
+		// Derivative of atan2(R10, R00) for a small rotation applied in the navigation frame
+		const Quat& q = state.navigation.attitude;
+		double r00 = 1.0 - 2.0 * (q.y * q.y + q.z * q.z);
+		double r10 = 2.0 * (q.x * q.y + q.w * q.z);
+		double r20 = 2.0 * (q.x * q.z - q.w * q.y);
+		double d = r00 * r00 + r10 * r10;
+
+		Matrix<Dim, ErrorStateFilter::StateDim> h;
+		if (d > 1e-9)
+		{
+			h(0, ErrorStateFilter::Attitude) = -r20 * r00 / d;
+			h(0, ErrorStateFilter::Attitude + 1) = -r20 * r10 / d;
+		}
+		h(0, ErrorStateFilter::Attitude + 2) = 1.0;
+		return h;
+	}
+
+	Matrix<Dim, Dim> covariance() const
+	{
+		return Matrix<Dim, Dim>::identity() * (noise * noise);
+	}
+};
+
+/*! \brief Apply a measurement update
+	\param measurement The measurement, see the class description for the required interface
+	\returns False if the innovation covariance could not be inverted, the state is left untouched then
+*/
+template <class Measurement>
+bool ErrorStateFilter::update(const Measurement& measurement)
+{
+	constexpr int M = Measurement::Dim;
+
+	Matrix<M, StateDim> h = measurement.jacobian(m_state);
+	Matrix<M, StateDim> hp = h * m_p;
+	Matrix<M, M> s = hp * h.transposed() + measurement.covariance();
+
+	Matrix<M, M> sInv;
+	if (!invert(s, sInv))
+		return false;
+
+	Matrix<StateDim, M> k = hp.transposed() * sInv;
+	inject(k * measurement.residual(m_state));
+
+	m_p -= k * hp;
+	symmetrize(m_p);
+	return true;
+}
+
+#endif
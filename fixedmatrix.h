@@ -0,0 +1,172 @@
+#ifndef FIXED_MATRIX_H
+#define FIXED_MATRIX_H
+
+#include <array>
+#include <cmath>
+#include <utility>
+
+/*! \brief Row-major matrix with compile-time dimensions, stored inline without heap allocations */
+template <int R, int C>
+struct Matrix
+{
+	static constexpr int Rows = R;
+	static constexpr int Cols = C;
+
+	std::array<double, R * C> m {};
+
+	double& operator()(int r, int c) { return m[r * C + c]; }
+	double operator()(int r, int c) const { return m[r * C + c]; }
+
+	static Matrix zero() { return Matrix(); }
+
+	static Matrix identity()
+	{
+		static_assert(R == C, "identity requires a square matrix");
+		Matrix result;
+		for (int i = 0; i < R; ++i)
+			result(i, i) = 1.0;
+		return result;
+	}
+
+	Matrix<C, R> transposed() const
+	{
+		Matrix<C, R> result;
+		for (int r = 0; r < R; ++r)
+			for (int c = 0; c < C; ++c)
+				result(c, r) = (*this)(r, c);
+		return result;
+	}
+
+	/*! \returns The \a BR x \a BC sub-matrix starting at row \a r0 and column \a c0 */
+	template <int BR, int BC>
+	Matrix<BR, BC> block(int r0, int c0) const
+	{
+		Matrix<BR, BC> result;
+		for (int r = 0; r < BR; ++r)
+			for (int c = 0; c < BC; ++c)
+				result(r, c) = (*this)(r0 + r, c0 + c);
+		return result;
+	}
+
+	/*! \brief Overwrite the sub-matrix starting at row \a r0 and column \a c0 with \a b */
+	template <int BR, int BC>
+	void setBlock(int r0, int c0, const Matrix<BR, BC>& b)
+	{
+		for (int r = 0; r < BR; ++r)
+			for (int c = 0; c < BC; ++c)
+				(*this)(r0 + r, c0 + c) = b(r, c);
+	}
+
+	Matrix& operator+=(const Matrix& b)
+	{
+		for (int i = 0; i < R * C; ++i)
+			m[i] += b.m[i];
+		return *this;
+	}
+
+	Matrix& operator-=(const Matrix& b)
+	{
+		for (int i = 0; i < R * C; ++i)
+			m[i] -= b.m[i];
+		return *this;
+	}
+
+	Matrix& operator*=(double s)
+	{
+		for (auto& v : m)
+			v *= s;
+		return *this;
+	}
+};
+
+template <int R, int C>
+Matrix<R, C> operator+(Matrix<R, C> a, const Matrix<R, C>& b)
+{
+	return a += b;
+}
+
+template <int R, int C>
+Matrix<R, C> operator-(Matrix<R, C> a, const Matrix<R, C>& b)
+{
+	return a -= b;
+}
+
+template <int R, int C>
+Matrix<R, C> operator*(Matrix<R, C> a, double s)
+{
+	return a *= s;
+}
+
+template <int R, int K, int C>
+Matrix<R, C> operator*(const Matrix<R, K>& a, const Matrix<K, C>& b)
+{
+	Matrix<R, C> result;
+	for (int r = 0; r < R; ++r)
+		for (int k = 0; k < K; ++k)
+		{
+			double v = a(r, k);
+			if (v == 0.0)
+				continue;
+			for (int c = 0; c < C; ++c)
+				result(r, c) += v * b(k, c);
+		}
+	return result;
+}
+
+/*! \brief Copy the upper triangle of a square matrix into the lower triangle */
+template <int N>
+void symmetrize(Matrix<N, N>& a)
+{
+	for (int r = 0; r < N; ++r)
+		for (int c = r + 1; c < N; ++c)
+			a(c, r) = a(r, c);
+}
+
+/*! \brief Invert a square matrix using Gauss-Jordan elimination with partial pivoting
+	\param a The matrix to invert
+	\param result Receives the inverse
+	\returns False if the matrix is singular
+*/
+template <int N>
+bool invert(Matrix<N, N> a, Matrix<N, N>& result)
+{
+	result = Matrix<N, N>::identity();
+	for (int col = 0; col < N; ++col)
+	{
+		int pivot = col;
+		for (int r = col + 1; r < N; ++r)
+			if (std::fabs(a(r, col)) > std::fabs(a(pivot, col)))
+				pivot = r;
+		if (std::fabs(a(pivot, col)) < 1e-300)
+			return false;
+
+		if (pivot != col)
+			for (int c = 0; c < N; ++c)
+			{
+				std::swap(a(col, c), a(pivot, c));
+				std::swap(result(col, c), result(pivot, c));
+			}
+
+		double inv = 1.0 / a(col, col);
+		for (int c = 0; c < N; ++c)
+		{
+			a(col, c) *= inv;
+			result(col, c) *= inv;
+		}
+
+		for (int r = 0; r < N; ++r)
+		{
+			if (r == col || a(r, col) == 0.0)
+				continue;
+			double f = a(r, col);
+			for (int c = 0; c < N; ++c)
+			{
+				a(r, c) -= f * a(col, c);
+				result(r, c) -= f * result(col, c);
+			}
+		}
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef IMU_MATH_H
+#define IMU_MATH_H
+
+#include <cmath>
+
+/*! \brief Plain 3-vector used by the host-side processing stages */
+struct Vec3
+{
+	double x = 0.0;
+	double y = 0.0;
+	double z = 0.0;
+};
+
+/*! \brief Scalar-first unit quaternion, same convention as XsQuaternion (w, x, y, z) */
+struct Quat
+{
+	double w = 1.0;
+	double x = 0.0;
+	double y = 0.0;
+	double z = 0.0;
+};
+
+inline Vec3 operator+(const Vec3& a, const Vec3& b)
+{
+	return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+inline Vec3 operator-(const Vec3& a, const Vec3& b)
+{
+	return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+inline Vec3 operator*(const Vec3& a, double s)
+{
+	return { a.x * s, a.y * s, a.z * s };
+}
+
+inline double dot(const Vec3& a, const Vec3& b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vec3 cross(const Vec3& a, const Vec3& b)
+{
+	return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+inline double norm(const Vec3& a)
+{
+	return std::sqrt(dot(a, a));
+}
+
+/*! \returns The Hamilton product a * b */
+inline Quat quatMultiply(const Quat& a, const Quat& b)
+{
+	return {
+		a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+		a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+		a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+		a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w
+	};
+}
+
+inline Quat quatConjugate(const Quat& q)
+{
+	return { q.w, -q.x, -q.y, -q.z };
+}
+
+inline Quat quatNormalized(const Quat& q)
+{
+	double n = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+	if (n <= 0.0)
+		return Quat();
+	return { q.w / n, q.x / n, q.y / n, q.z / n };
+}
+
+/*! \returns The vector \a v rotated by \a q, i.e. q * v * q^-1 */
+inline Vec3 quatRotate(const Quat& q, const Vec3& v)
+{
+	Vec3 u = { q.x, q.y, q.z };
+	Vec3 t = cross(u, v) * 2.0;
+	return v + t * q.w + cross(u, t);
+}
+
+/*! \returns The quaternion rotating over the rotation vector \a r (axis * angle in radians) */
+inline Quat quatFromRotationVector(const Vec3& r)
+{
+	double angle = norm(r);
+	if (angle < 1e-12)
+		return quatNormalized({ 1.0, 0.5 * r.x, 0.5 * r.y, 0.5 * r.z });
+	double s = std::sin(0.5 * angle) / angle;
+	return { std::cos(0.5 * angle), r.x * s, r.y * s, r.z * s };
+}
+
+/*! \returns The rotation vector (axis * angle in radians) of \a q, using the shortest rotation */
+inline Vec3 quatToRotationVector(const Quat& q)
+{
+	Quat p = q.w < 0.0 ? Quat { -q.w, -q.x, -q.y, -q.z } : q;
+	double s = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+	if (s < 1e-12)
+		return { 2.0 * p.x, 2.0 * p.y, 2.0 * p.z };
+	double angle = 2.0 * std::atan2(s, p.w);
+	return { p.x * angle / s, p.y * angle / s, p.z * angle / s };
+}
+
+/*! \returns The heading (rotation about the navigation Z axis) of \a q in radians */
+inline double quatYaw(const Quat& q)
+{
+	return std::atan2(2.0 * (q.w * q.z + q.x * q.y), 1.0 - 2.0 * (q.y * q.y + q.z * q.z));
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include "loadgenerator.h"
+
+#include "csvlog.h"
+#include "strapdown.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct LoadGenerator::VirtualDevice
+{
+	XsString address;
+	shared_ptr<const LogFile> log;
+	size_t logIndex = 0;
+	mt19937 rng;
+	double ticksPerSample = 0.0;
+	double sampleTimeFine = 0.0;
+	Clock::time_point nextSample;
+	Clock::time_point stalledUntil;
+	Clock::time_point lastDelivery;
+	Clock::time_point onlineAt;
+};
+
+namespace
+{
+struct Delivery
+{
+	Clock::time_point time;
+	size_t device;
+	XsDataPacket packet;
+
+	bool operator>(const Delivery& other) const { return time > other.time; }
+};
+
+Clock::duration toDuration(double seconds)
+{
+	return chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+}
+}
+
+/*! \brief Constructor
+	\details Loads the recorded logfiles, if any, and sets up the virtual devices. Devices replay the
+	logfiles round robin and each device gets its own random clock drift.
+	\param handler The handler whose packet buffers receive the generated packets
+	\param settings The load to generate
+*/
+LoadGenerator::LoadGenerator(XdpcHandler& handler, const LoadSettings& settings)
+	: m_handler(handler)
+	, m_settings(settings)
+	, m_devices(settings.deviceCount)
+	, m_running(false)
+	, m_generated(0)
+	, m_delivered(0)
+	, m_lost(0)
+	, m_dropouts(0)
+	, m_online(new atomic<bool>[settings.deviceCount])
+{
+	vector<shared_ptr<const LogFile>> logs;
+	for (auto const& path : settings.logFiles)
+	{
+		auto log = make_shared<LogFile>();
+		if (readLogFile(path, *log) && !log->samples.empty())
+			logs.push_back(log);
+		else
+			cout << "Could not read logfile " << path << ", skipping it." << endl;
+	}
+
+	mt19937 rng(settings.seed);
+	uniform_real_distribution<double> drift(-settings.clockDriftPpm, settings.clockDriftPpm);
+	for (size_t i = 0; i < m_devices.size(); ++i)
+	{
+		VirtualDevice& device = m_devices[i];
+		char address[18];
+		snprintf(address, sizeof(address), "F0:00:00:00:%02X:%02X", static_cast<unsigned>((i >> 8) & 0xff), static_cast<unsigned>(i & 0xff));
+		device.address = XsString(address);
+		device.rng.seed(settings.seed + static_cast<unsigned>(i) + 1);
+		device.ticksPerSample = settings.ticksPerSecond / settings.outputRate * (1.0 + 1e-6 * drift(rng));
+		device.sampleTimeFine = uniform_real_distribution<double>(0.0, 4e9)(rng);
+		if (!logs.empty())
+			device.log = logs[i % logs.size()];
+		m_addresses.push_back(device.address);
+		m_online[i] = true;
+	}
+}
+
+/*! \brief Destructor, stops the generator thread */
+LoadGenerator::~LoadGenerator()
+{
+	stop();
+}
+
+/*! \brief Start delivering packets from the generator thread */
+void LoadGenerator::start()
+{
+	if (m_running.exchange(true))
+		return;
+	m_thread = thread(&LoadGenerator::run, this);
+}
+
+/*! \brief Stop delivering packets and wait for the generator thread to finish */
+void LoadGenerator::stop()
+{
+	m_running = false;
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+/*! \returns The bluetooth addresses of the virtual devices */
+vector<XsString> LoadGenerator::deviceAddresses() const
+{
+	return m_addresses;
+}
+
+/*! \returns False while the virtual device is powered down because of a simulated dropout
+	\param device The index of the virtual device
+*/
+bool LoadGenerator::deviceOnline(size_t device) const
+{
+	return m_online[device];
+}
+
+/*! \returns The number of packets the virtual devices produced, including lost ones */
+uint64_t LoadGenerator::packetsGenerated() const
+{
+	return m_generated;
+}
+
+/*! \returns The number of packets handed to the handler */
+uint64_t LoadGenerator::packetsDelivered() const
+{
+	return m_delivered;
+}
+
+/*! \returns The number of packets lost in transmission or because the device was powered down */
+uint64_t LoadGenerator::packetsLost() const
+{
+	return m_lost;
+}
+
+/*! \returns The number of simulated device dropouts */
+uint64_t LoadGenerator::dropouts() const
+{
+	return m_dropouts;
+}
+
+/*! \brief The generator thread
+	\details Each virtual device produces a sample every period of its own drifting clock. A produced
+	sample is either lost, or queued for delivery after a random transport delay. A stall holds back
+	all deliveries of a device, which then arrive together as a burst, the way BLE connection events
+	deliver them. Deliveries are handed to the handler in time order from this single thread.
+*/
+void LoadGenerator::run()
+{
+	priority_queue<Delivery, vector<Delivery>, greater<Delivery>> pending;
+	Clock::duration period = toDuration(1.0 / m_settings.outputRate);
+	double dropoutProbability = m_settings.dropoutRate / (60.0 * m_settings.outputRate);
+
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < m_devices.size(); ++i)
+	{
+		m_devices[i].nextSample = start + period * i / m_devices.size();
+		m_devices[i].lastDelivery = start;
+	}
+
+	while (m_running)
+	{
+		Clock::time_point next = Clock::now() + chrono::seconds(1);
+		for (auto const& device : m_devices)
+			next = min(next, device.nextSample);
+		if (!pending.empty())
+			next = min(next, pending.top().time);
+		this_thread::sleep_until(next);
+
+		Clock::time_point now = Clock::now();
+		for (size_t i = 0; i < m_devices.size(); ++i)
+		{
+			VirtualDevice& device = m_devices[i];
+			while (device.nextSample <= now)
+			{
+				Clock::time_point sampleTime = device.nextSample;
+				device.nextSample += period;
+				XsDataPacket packet = makePacket(device);
+				++m_generated;
+
+				if (!m_online[i])
+				{
+					if (sampleTime < device.onlineAt)
+					{
+						++m_lost;
+						continue;
+					}
+					m_online[i] = true;
+				}
+
+				uniform_real_distribution<double> uniform;
+				if (uniform(device.rng) < dropoutProbability)
+				{
+					// Powered down, what the device already delivered stays buffered like after XDS_Destructing
+					m_online[i] = false;
+					device.onlineAt = sampleTime + toDuration(m_settings.dropoutDuration);
+					++m_dropouts;
+					++m_lost;
+					continue;
+				}
+
+				if (uniform(device.rng) < m_settings.packetLoss)
+				{
+					++m_lost;
+					continue;
+				}
+
+				if (uniform(device.rng) < m_settings.burstProbability)
+					device.stalledUntil = sampleTime + period * m_settings.burstLength;
+
+				double delayMs = fabs(normal_distribution<double>(0.0, m_settings.jitterMs)(device.rng));
+				Clock::time_point delivery = max(sampleTime + toDuration(1e-3 * delayMs), max(device.stalledUntil, device.lastDelivery));
+				device.lastDelivery = delivery;
+				pending.push({ delivery, i, packet });
+			}
+		}
+
+		while (!pending.empty() && pending.top().time <= now)
+		{
+			const Delivery& delivery = pending.top();
+			if (m_online[delivery.device])
+			{
+				m_handler.bufferPacket(m_devices[delivery.device].address, delivery.packet);
+				++m_delivered;
+			}
+			else
+				++m_lost;
+			pending.pop();
+		}
+	}
+}
+
+/*! \brief Create the next packet of a virtual device
+	\details Replays the device's logfile in a loop, or synthesizes a device at rest with white
+	noise on both increments when no logfile was given
+	\param device The virtual device
+	\returns A packet with SampleTimeFine, orientation increment and velocity increment
+*/
+XsDataPacket LoadGenerator::makePacket(VirtualDevice& device)
+{
+	Quat dq;
+	Vec3 dv;
+	if (device.log)
+	{
+		const LogSample& sample = device.log->samples[device.logIndex];
+		device.logIndex = (device.logIndex + 1) % device.log->samples.size();
+		dq = sample.dq;
+		dv = sample.dv;
+	}
+	else
+	{
+		double dt = 1.0 / m_settings.outputRate;
+		normal_distribution<double> gyro(0.0, 0.005 * dt);
+		normal_distribution<double> acc(0.0, 0.02 * dt);
+		dq = quatFromRotationVector({ gyro(device.rng), gyro(device.rng), gyro(device.rng) });
+		dv = { acc(device.rng), acc(device.rng), GRAVITY * dt + acc(device.rng) };
+	}
+
+	device.sampleTimeFine = fmod(device.sampleTimeFine + device.ticksPerSample, 4294967296.0);
+
+	XsDataPacket packet;
+	packet.setSampleTimeFine(static_cast<uint32_t>(device.sampleTimeFine));
+	packet.setOrientationIncrement(XsQuaternion(dq.w, dq.x, dq.y, dq.z));
+	packet.setVelocityIncrement(XsVector3(dv.x, dv.y, dv.z));
+	return packet;
+}
@@ -0,0 +1,70 @@
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include "xdpchandler.h"
+#include "user_settings.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LoadSettings
+{
+	size_t deviceCount = 20;				//!< Number of virtual devices
+	double outputRate = 60.0;				//!< Output rate of every virtual device in Hz
+	double jitterMs = 2.0;					//!< Standard deviation of the delivery delay in ms
+	double burstProbability = 0.005;		//!< Probability per packet that delivery stalls and resumes in a burst
+	size_t burstLength = 10;				//!< Number of sample periods a stall lasts
+	double packetLoss = 0.001;				//!< Probability that a packet never arrives
+	double dropoutRate = 0.0;				//!< Expected device dropouts per device per minute
+	double dropoutDuration = 3.0;			//!< Duration of a dropout in seconds
+	double clockDriftPpm = 50.0;			//!< Maximum clock drift of a virtual device in ppm
+	double ticksPerSecond = UserSettings().m_sampleTimeFineTicksPerSecond;	//!< Rate of the SampleTimeFine counter
+	std::vector<std::string> logFiles;		//!< Recorded logfiles to replay, synthetic data is generated when empty
+	unsigned seed = 1;
+};
+
+/*! \brief Emulates the SDK callback thread for a set of virtual Movella DOT devices
+	\details Feeds synthesized or recorded delta quantities packets into the same packet buffer the
+	onLiveDataAvailable callback fills, and powers virtual devices down and up again, which stops
+	their packets for the dropout. All deliveries happen on one thread, like the SDK does.
+*/
+class LoadGenerator
+{
+public:
+	LoadGenerator(XdpcHandler& handler, const LoadSettings& settings);
+	~LoadGenerator();
+
+	void start();
+	void stop();
+
+	std::vector<XsString> deviceAddresses() const;
+	bool deviceOnline(size_t device) const;
+	uint64_t packetsGenerated() const;
+	uint64_t packetsDelivered() const;
+	uint64_t packetsLost() const;
+	uint64_t dropouts() const;
+
+private:
+	struct VirtualDevice;
+
+	void run();
+	XsDataPacket makePacket(VirtualDevice& device);
+
+	XdpcHandler& m_handler;
+	LoadSettings m_settings;
+	std::vector<VirtualDevice> m_devices;
+	std::vector<XsString> m_addresses;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<uint64_t> m_generated;
+	std::atomic<uint64_t> m_delivered;
+	std::atomic<uint64_t> m_lost;
+	std::atomic<uint64_t> m_dropouts;
+	std::unique_ptr<std::atomic<bool>[]> m_online;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include <iostream>
+#include <iomanip>
+#include <csignal>
+#include <cstdlib>
+#include <map>
+#include "xdpchandler.h"
+#include "loadgenerator.h"
+#include "strapdown.h"
+
+using namespace std;
+
+volatile sig_atomic_t isRunning = true;
+
+void signalHandler(int signum)
+{
+	if (signum == SIGINT)
+		isRunning = false;
+}
+
+void printUsage()
+{
+	cout << "Usage: loadtest [--batch] [devices] [output rate] [seconds] [dropouts/min] [logfile.csv ...]" << endl;
+	cout << "Drives the XdpcHandler packet buffers from virtual devices and reports the sustained throughput." << endl;
+	cout << "With --batch the consumer drains all devices at once with drainPackets instead of getNextPacket." << endl;
+}
+
+//--------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	signal(SIGINT, signalHandler);
+
+	LoadSettings settings;
+	double seconds = 10.0;
+	if (argc > 1 && (string(argv[1]) == "-h" || string(argv[1]) == "--help"))
+	{
+		printUsage();
+		return 0;
+	}
+	bool batchMode = argc > 1 && string(argv[1]) == "--batch";
+	if (batchMode)
+	{
+		--argc;
+		++argv;
+	}
+	if (argc > 1)
+		settings.deviceCount = strtoul(argv[1], nullptr, 10);
+	if (argc > 2)
+		settings.outputRate = atof(argv[2]);
+	if (argc > 3)
+		seconds = atof(argv[3]);
+	if (argc > 4)
+		settings.dropoutRate = atof(argv[4]);
+	for (int i = 5; i < argc; ++i)
+		settings.logFiles.push_back(argv[i]);
+
+	if (settings.deviceCount == 0 || settings.outputRate <= 0.0 || seconds <= 0.0)
+	{
+		printUsage();
+		return -1;
+	}
+
+	XdpcHandler xdpcHandler;
+	LoadGenerator generator(xdpcHandler, settings);
+	vector<XsString> addresses = generator.deviceAddresses();
+	vector<StrapdownIntegrator> integrators(addresses.size());
+	double dt = 1.0 / settings.outputRate;
+
+	cout << "Generating " << settings.deviceCount << " devices @ " << settings.outputRate << " Hz for " << seconds << " s" << endl;
+	cout << string(83, '-') << endl;
+
+	uint64_t consumed = 0;
+	int64_t startTime = XsTime::timeStampNow();
+	int64_t lastReport = startTime;
+	generator.start();
+
+	map<XsString, size_t> deviceIndex;
+	for (size_t i = 0; i < addresses.size(); ++i)
+		deviceIndex[addresses[i]] = i;
+	PacketBatch batch;
+
+	while (isRunning && XsTime::timeStampNow() - startTime < seconds * 1000)
+	{
+		// The same consumer pattern as the main loop: everything buffered for all devices per pass
+		if (batchMode && xdpcHandler.drainPackets(batch))
+		{
+			for (size_t d = 0; d < batch.devices(); ++d)
+			{
+				StrapdownIntegrator& integrator = integrators[deviceIndex[batch.bluetoothAddress[d]]];
+				size_t end = batch.deviceFirst[d] + batch.deviceCount[d];
+				for (size_t i = batch.deviceFirst[d]; i < end; ++i)
+					if (batch.valid[i])
+						integrator.propagate({ batch.dqW[i], batch.dqX[i], batch.dqY[i], batch.dqZ[i] }, { batch.dvX[i], batch.dvY[i], batch.dvZ[i] }, dt);
+			}
+			consumed += batch.samples();
+		}
+
+		// The previous consumer pattern: one packet per device per pass
+		for (size_t i = 0; i < addresses.size() && !batchMode; ++i)
+		{
+			if (!xdpcHandler.packetAvailable(addresses[i]))
+				continue;
+
+			XsDataPacket packet = xdpcHandler.getNextPacket(addresses[i]);
+			if (packet.containsOrientationIncrement() && packet.containsVelocityIncrement())
+			{
+				XsQuaternion q = packet.orientationIncrement();
+				XsVector v = packet.velocityIncrement();
+				integrators[i].propagate({ q.w(), q.x(), q.y(), q.z() }, { v.value(0), v.value(1), v.value(2) }, dt);
+			}
+			++consumed;
+		}
+
+		int64_t now = XsTime::timeStampNow();
+		if (now - lastReport >= 1000)
+		{
+			cout << "\r" << setw(8) << (now - startTime) / 1000 << " s"
+				<< "  consumed: " << setw(10) << consumed
+				<< "  dropped: " << setw(8) << xdpcHandler.packetsDropped()
+				<< "  lost: " << setw(8) << generator.packetsLost() << flush;
+			lastReport = now;
+		}
+		XsTime::msleep(0);
+	}
+	generator.stop();
+	double elapsed = (XsTime::timeStampNow() - startTime) / 1000.0;
+
+	uint64_t generated = generator.packetsGenerated();
+	uint64_t dropped = xdpcHandler.packetsDropped();
+	cout << "\n" << string(83, '-') << "\n";
+	cout << "Generated:      " << generated << endl;
+	cout << "Delivered:      " << generator.packetsDelivered() << endl;
+	cout << "Consumed:       " << consumed << endl;
+	cout << "Buffer drops:   " << dropped << endl;
+	cout << "Lost/dropouts:  " << generator.packetsLost() << " / " << generator.dropouts() << endl;
+	cout << "Throughput:     " << fixed << setprecision(1) << consumed / elapsed << " packets/s" << endl;
+	if (generated)
+		cout << "Drop rate:      " << fixed << setprecision(3) << 100.0 * dropped / generated << "% (buffer), "
+			<< 100.0 * generator.packetsLost() / generated << "% (link)" << endl;
+
+	return 0;
+}
@@ -1,13 +1,42 @@
 #include <iostream>
 #include <iomanip>
 #include <csignal>  // Include this for signal handling
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <memory>
 #include "xdpchandler.h"
+#include "user_settings.h"
+#include "deviceintegration.h"
+#include "checkpoint.h"
+#include "noiseparameters.h"
+#include "realtime.h"
+#include "tracing.h"
 
 using namespace std;
 XdpcHandler xdpcHandler;
 
+map<XsString, DeviceIntegration> integrations;
+unique_ptr<RigIntegration> rig;
+CheckpointFile checkpointFile;
+vector<DeviceCheckpoint> checkpointSnapshot;
+vector<DeviceCheckpoint> savedSnapshot;		// Filled in place by every save, reserved up front
+const char* const RIG_CHECKPOINT = "rig";		// Checkpoint record of the rig integration, next to the device addresses
+int64_t checkpointTimestamp = 0;
+bool realtimeMode = UserSettings().m_realtime;
+
 int connectIMU();
 void initLogfile();
+void applyNoiseParameters();
+void setupRig();
+bool isRigDevice(const XsString& bluetoothAddress);
+void printWriterStats(const XsString& name, const SessionIndexWriter& trajectory);
+const DeviceCheckpoint* findCheckpoint(const XsString& bluetoothAddress);
+void restoreIntegration(DeviceIntegration& integration, const DeviceCheckpoint& checkpoint);
+void fillCheckpoint(DeviceCheckpoint& checkpoint, const char* name, const DeviceIntegration& integration, double ticksPerSecond, bool headingResetDone);
+bool restoreCheckpoint();
+void saveCheckpoint(bool headingResetDone);
 
 // Global variable to control the main loop
 volatile sig_atomic_t isRunning = true;
@@ -19,25 +48,29 @@ void signalHandler(int signum) {
     }
 }
 
-void printVelocityIncrement(XsVector vel)
+void printVelocityIncrement(const Vec3& vel)
 {
-	cout << "X:" << right << setw(7) << fixed << setprecision(2) << vel.value(0)
-		<< ", Y:" << right << setw(7) << fixed << setprecision(2) << vel.value(1)
-		<< ", Z:" << right << setw(7) << fixed << setprecision(2) << vel.value(2)
+	cout << "X:" << right << setw(7) << fixed << setprecision(2) << vel.x
+		<< ", Y:" << right << setw(7) << fixed << setprecision(2) << vel.y
+		<< ", Z:" << right << setw(7) << fixed << setprecision(2) << vel.z
 		<< " | ";
 }
 
-void printOrientationIncrement(XsQuaternion quat)
+void printOrientationIncrement(const Quat& quat)
 {
-	cout << "W:" << right << setw(7) << fixed << setprecision(2) << quat.w()
-		<< ", X:" << right << setw(7) << fixed << setprecision(2) << quat.x()
-		<< ", Y:" << right << setw(7) << fixed << setprecision(2) << quat.y()
-		<< ", Z:" << right << setw(7) << fixed << setprecision(2) << quat.z();
+	cout << "W:" << right << setw(7) << fixed << setprecision(2) << quat.w
+		<< ", X:" << right << setw(7) << fixed << setprecision(2) << quat.x
+		<< ", Y:" << right << setw(7) << fixed << setprecision(2) << quat.y
+		<< ", Z:" << right << setw(7) << fixed << setprecision(2) << quat.z;
 }
 
 //--------------------------------------------------------------------------------
-int main(void)
+int main(int argc, char* argv[])
 {
+	for (int i = 1; i < argc; ++i)
+		if (strcmp(argv[i], "--realtime") == 0)
+			realtimeMode = true;
+
 	// Set the signal handler
     signal(SIGINT, signalHandler);
 
@@ -47,57 +80,113 @@ int main(void)
 		return -1;
 	}
 
+	// Resume from the last checkpoint, when the previous session did not end cleanly. It is read
+	// before the logfiles are set up, so the trajectories of resumed devices are continued.
+	if (!checkpointFile.open(UserSettings().m_checkpointFileName.toStdString(), UserSettings().m_checkpointMaxDevices))
+		cout << "Could not open checkpoint file " << UserSettings().m_checkpointFileName << ", running without checkpoints." << endl;
+	else if (!checkpointFile.load(checkpointSnapshot, checkpointTimestamp))
+		checkpointSnapshot.clear();
+	savedSnapshot.reserve(UserSettings().m_checkpointMaxDevices);
+
+	// The rig is set up first, its devices are only integrated as part of it and get no files of their own
+	applyNoiseParameters();
+	setupRig();
 	initLogfile();
 /*-------------------------------------------------
 				SCAN PROCESS
 -------------------------------------------------*/
-	bool orientationResetDone = false;
+	bool orientationResetDone = restoreCheckpoint();
 	int64_t startTime = XsTime::timeStampNow();
+	int64_t lastCheckpointTime = startTime;
+	int64_t checkpointIntervalMs = UserSettings().m_checkpointIntervalMs;
+	PacketBatch batch;
+	// Real-time mode is entered here, so the SDK and writer threads started above do not inherit the loop's priority
+	if (realtimeMode)
+		enterRealtimeMode(batch, xdpcHandler.connectedDots().size());
+	CycleTimer cycleTimer(UserSettings().m_realtimePeriodUs);
+	map<XsString, pair<Vec3, Quat>> latestIncrements;
 	while (isRunning)
 	{
-		if (xdpcHandler.packetsAvailable())
+		// Take everything that arrived since the last pass, a backlog after a hiccup is processed in one go
+		if (xdpcHandler.drainPackets(batch))
 		{
-			cout << "\r";
-			for (auto const& device : xdpcHandler.connectedDots())
+			TRACE_SPAN("main::processPackets");
+			for (size_t d = 0; d < batch.devices(); ++d)
 			{
-				// Retrieve a packet
-				XsDataPacket packet = xdpcHandler.getNextPacket(device->bluetoothAddress());
+				TRACE_SPAN("main::processDevice");
+				TRACE_SPAN_BEGIN(integrating, "main::integrate");
+				int64_t now = XsTime::timeStampNow();
+				if (!rig || !addBatchToRig(*rig, batch, d, now))
+					integrateBatch(integrations[batch.bluetoothAddress[d]], batch, d, now / 1000.0);
+				TRACE_SPAN_END(integrating);
 
-				// Get dv
-				if (packet.containsVelocityIncrement())
-				{
-					XsVector vel = packet.velocityIncrement();
-					printVelocityIncrement();
-				}
+				size_t last = batch.deviceFirst[d] + batch.deviceCount[d] - 1;
+				if (batch.valid[last])
+					latestIncrements[batch.bluetoothAddress[d]] = { { batch.dvX[last], batch.dvY[last], batch.dvZ[last] },
+						{ batch.dqW[last], batch.dqX[last], batch.dqY[last], batch.dqZ[last] } };
+			}
 
-				// Get dq
-				if (packet.containsOrientationIncrement())
+			// Show the latest dv and dq of every device in the order of the headers, also of those without new samples.
+			// Not in real-time mode, a blocking terminal write would stall the pinned loop.
+			if (!realtimeMode)
+			{
+				TRACE_SPAN("main::print");
+				cout << "\r";
+				for (auto const& device : xdpcHandler.connectedDots())
 				{
-					XsQuaternion quat = packet.orientationIncrement();
-					printOrientationIncrement();
+					auto latest = latestIncrements.find(device->bluetoothAddress());
+					if (latest == latestIncrements.end())
+						continue;
+					printVelocityIncrement(latest->second.first);
+					printOrientationIncrement(latest->second.second);
 				}
+				cout << flush;
+			}
+
+			if (rig)
+			{
+				TRACE_SPAN("main::integrateRig");
+				integrateRig(*rig, XsTime::timeStampNow());
 			}
 
 			// Reset heading
-			cout << flush;
 			if (!orientationResetDone && (XsTime::timeStampNow() - startTime) > 5000) // Reset over 5s
 			{
+				TRACE_SPAN("main::resetHeading");
 				for (auto const& device : xdpcHandler.connectedDots())
 				{
 					cout << endl << "Resetting heading for device " << device->bluetoothAddress() << ": ";
 					if (device->resetOrientation(XRM_Heading))
+					{
 						cout << "OK";
+						if (!isRigDevice(device->bluetoothAddress()))
+							integrations[device->bluetoothAddress()].filter.update(HeadingMeasurement());
+					}
 					else
 						cout << "NOK: " << device->lastResultText();
 				}
+				if (rig)
+					rig->integration.filter.update(HeadingMeasurement());
 				cout << endl;
 				orientationResetDone = true;
 			}
+
+			if (checkpointFile.isOpen() && XsTime::timeStampNow() - lastCheckpointTime >= checkpointIntervalMs)
+			{
+				TRACE_SPAN("main::checkpoint");
+				saveCheckpoint(orientationResetDone);
+				lastCheckpointTime = XsTime::timeStampNow();
+			}
 		}
-		XsTime::msleep(0);
+		if (realtimeMode)
+			cycleTimer.wait();
+		else
+			XsTime::msleep(0);
 	}
 	cout << "\n" << string(83, '-') << "\n";
 	cout << endl;
+	if (realtimeMode)
+		cout << cycleTimer.report() << endl;
 
 	for (auto const& device : xdpcHandler.connectedDots())
 	{
@@ -109,6 +198,13 @@ int main(void)
 	}
 	cout << endl << endl;
 
+	// The heading reset is undone, so a clean exit leaves nothing to resume from
+	if (checkpointFile.isOpen())
+	{
+		checkpointFile.close();
+		remove(UserSettings().m_checkpointFileName.c_str());
+	}
+
 /*-------------------------------------------------
 				STOP SCAN PROCESS
 -------------------------------------------------*/
@@ -122,8 +218,22 @@ int main(void)
 			cout << "Failed to disable logging.";
 	}
 
+	for (auto& integration : integrations)
+	{
+		closeTrajectories(integration.second);
+		printWriterStats(integration.first, integration.second.trajectory);
+	}
+	if (rig)
+	{
+		closeTrajectories(rig->integration);
+		printWriterStats("rig", rig->integration.trajectory);
+		cout << "Virtual IMU: " << rig->fusedSamples << " sample(s) from " << rig->devices.size() << " devices, "
+			<< rig->rejectedSamples << " with outliers rejected" << endl;
+	}
+
 	xdpcHandler.cleanup();
 
+	TRACE_FLUSH(UserSettings().m_traceFileName.c_str());
 	return 0;
 }
 
@@ -158,6 +268,7 @@ int connectIMU()
 
 void initLogfile()
 {
+	TRACE_SPAN("main::initLogfile");
 	for (auto& device : xdpcHandler.connectedDots())
 	{		
 		auto filterProfiles = device->getAvailableFilterProfiles();
@@ -179,6 +290,13 @@ void initLogfile()
 		if (!device->enableLogging(logFileName))
 			cout << "Failed to enable logging. Reason: " << device->lastResultText() << endl;
 
+		// The integrated trajectory and its query index are stored next to the logfile, a resumed device appends to it
+		if (isRigDevice(device->bluetoothAddress()))
+			cout << "Device " << device->bluetoothAddress() << " is integrated as part of the rig" << endl;
+		else if (!openTrajectories(integrations[device->bluetoothAddress()], logFileName.toStdString(), device->bluetoothAddress().toStdString(),
+			trajectoryWriterSettings(realtimeMode), findCheckpoint(device->bluetoothAddress()) != nullptr))
+			cout << "Failed to create the trajectory file for " << logFileName << endl;
+
 		cout << "Putting device into measurement mode." << endl;
 		if (!device->startMeasurement(XsPayloadMode::DeltaQuantities))
 		{
@@ -194,4 +312,186 @@ void initLogfile()
 	for (auto const& device : xdpcHandler.connectedDots())
 		cout << setw(42) << left << device->bluetoothAddress();
 	cout << endl;
-}
\ No newline at end of file
+}
+
+void applyNoiseParameters()
+{
+	map<string, FilterNoise> noise;
+	if (!loadNoiseParameters(UserSettings().m_noiseParameterFileName.toStdString(), noise))
+	{
+		cout << "No noise parameter file " << UserSettings().m_noiseParameterFileName << ", using the default filter noise settings." << endl;
+		return;
+	}
+
+	for (auto const& device : xdpcHandler.connectedDots())
+	{
+		auto match = noise.find(device->bluetoothAddress().toStdString());
+		if (match == noise.end())
+		{
+			cout << "No noise parameters for device " << device->bluetoothAddress() << ", using the defaults." << endl;
+			continue;
+		}
+
+		// The initial uncertainties come from the noise settings, so restart the filter with them
+		ErrorStateFilter& filter = integrations[device->bluetoothAddress()].filter;
+		filter.setNoise(match->second);
+		filter.reset();
+		cout << "Loaded the noise parameters of device " << device->bluetoothAddress() << endl;
+	}
+}
+
+void setupRig()
+{
+	vector<SensorMount> mounts;
+	if (!loadSensorMounts(UserSettings().m_rigFileName.toStdString(), mounts))
+		return;
+
+	// Only connected devices take part, the others would hold back the common timeline
+	vector<SensorMount> connected;
+	vector<FilterNoise> noise;
+	for (auto const& mount : mounts)
+	{
+		XsString address(mount.bluetoothAddress);
+		auto const& dots = xdpcHandler.connectedDots();
+		if (none_of(dots.begin(), dots.end(), [&](XsDotDevice* device) { return device->bluetoothAddress() == address; }))
+		{
+			cout << "Rig device " << mount.bluetoothAddress << " is not connected." << endl;
+			continue;
+		}
+		connected.push_back(mount);
+		noise.push_back(integrations[address].filter.noise());
+	}
+	if (connected.size() < 2)
+	{
+		cout << "Fewer than two devices of rig " << UserSettings().m_rigFileName << " are connected, integrating every device on its own." << endl;
+		return;
+	}
+
+	rig.reset(new RigIntegration(connected, noise, UserSettings().m_rigRateHz));
+	for (auto const& mount : connected)
+		integrations.erase(XsString(mount.bluetoothAddress));
+	if (!openTrajectories(rig->integration, "logfile_rig.csv", "rig", trajectoryWriterSettings(realtimeMode), findCheckpoint(XsString(RIG_CHECKPOINT)) != nullptr))
+		cout << "Failed to create the trajectory file for the rig" << endl;
+	cout << "Integrating " << connected.size() << " devices as one virtual IMU at " << UserSettings().m_rigRateHz << " Hz" << endl;
+}
+
+//! Returns true if the device is integrated as part of the rig instead of on its own
+bool isRigDevice(const XsString& bluetoothAddress)
+{
+	return rig && rig->devices.count(bluetoothAddress) > 0;
+}
+
+void printWriterStats(const XsString& name, const SessionIndexWriter& trajectory)
+{
+	AsyncWriterStats stats = trajectory.writerStats();
+	cout << "Trajectory writer " << name << ": " << stats.bytesWritten << " bytes"
+		<< (stats.usingIoUring ? " via io_uring" : " via pwrite")
+		<< ", max queue depth " << stats.maxQueueDepth
+		<< ", write latency mean " << stats.meanWriteLatencyUs << " us max " << stats.maxWriteLatencyUs << " us"
+		<< ", " << stats.producerStalls << " stall(s) of the packet loop" << (stats.failed ? ", WRITE ERRORS" : "") << endl;
+}
+
+/*-------------------------------------------------
+				CHECKPOINTS
+-------------------------------------------------*/
+const DeviceCheckpoint* findCheckpoint(const XsString& bluetoothAddress)
+{
+	string address = bluetoothAddress.toStdString();
+	auto match = find_if(checkpointSnapshot.begin(), checkpointSnapshot.end(), [&](const DeviceCheckpoint& d) { return address == d.bluetoothAddress; });
+	return match == checkpointSnapshot.end() ? nullptr : &*match;
+}
+
+bool restoreCheckpoint()
+{
+	TRACE_SPAN("main::restoreCheckpoint");
+	if (checkpointSnapshot.empty())
+		return false;
+
+	size_t restored = 0;
+	bool headingResetDone = true;
+	for (auto const& device : xdpcHandler.connectedDots())
+	{
+		if (isRigDevice(device->bluetoothAddress()))
+			continue;
+		const DeviceCheckpoint* match = findCheckpoint(device->bluetoothAddress());
+		if (!match)
+		{
+			headingResetDone = false;
+			continue;
+		}
+
+		restoreIntegration(integrations[device->bluetoothAddress()], *match);
+		headingResetDone = headingResetDone && match->headingResetDone;
+		++restored;
+	}
+
+	// The rig has its own record, without it the rig filter starts over and needs the heading reset
+	if (rig)
+	{
+		const DeviceCheckpoint* match = findCheckpoint(XsString(RIG_CHECKPOINT));
+		if (match)
+		{
+			restoreIntegration(rig->integration, *match);
+			headingResetDone = headingResetDone && match->headingResetDone;
+			++restored;
+		}
+		else
+			headingResetDone = false;
+	}
+
+	cout << "Resumed " << restored << " integration(s) from a checkpoint of " << (XsTime::timeStampNow() - checkpointTimestamp) << " ms ago" << endl;
+	return restored > 0 && headingResetDone;
+}
+
+void saveCheckpoint(bool headingResetDone)
+{
+	// A resumed session appends to the trajectories, they must hold every pose up to the saved state
+	for (auto& integration : integrations)
+	{
+		integration.second.trajectory.flush();
+		integration.second.smoothedTrajectory.flush();
+	}
+	if (rig)
+	{
+		rig->integration.trajectory.flush();
+		rig->integration.smoothedTrajectory.flush();
+	}
+
+	// Runs in the packet loop, the records are filled in place without allocating
+	static const double ticksPerSecond = UserSettings().m_sampleTimeFineTicksPerSecond;
+	savedSnapshot.clear();
+	for (auto const& integration : integrations)
+	{
+		if (savedSnapshot.size() == savedSnapshot.capacity())
+			break;
+		savedSnapshot.emplace_back();
+		fillCheckpoint(savedSnapshot.back(), integration.first.c_str(), integration.second, ticksPerSecond, headingResetDone);
+	}
+	if (rig && savedSnapshot.size() < savedSnapshot.capacity())
+	{
+		savedSnapshot.emplace_back();
+		fillCheckpoint(savedSnapshot.back(), RIG_CHECKPOINT, rig->integration, RigIntegration::ticksPerSecond, headingResetDone);
+	}
+	checkpointFile.save(savedSnapshot, XsTime::timeStampNow());
+}
+
+void restoreIntegration(DeviceIntegration& integration, const DeviceCheckpoint& checkpoint)
+{
+	// The filter continues with the uncertainty it had at the checkpoint, not with the initial one
+	integration.filter.restore(checkpoint.state, checkpoint.covariance);
+	integration.smoother.reset(checkpoint.state.navigation);
+	integration.lastSampleTimeFine = checkpoint.lastSampleTimeFine;
+	integration.anchorTime = checkpoint.sampleTime;
+	integration.ticksSinceAnchor = 0;
+	integration.started = true;
+}
+
+void fillCheckpoint(DeviceCheckpoint& checkpoint, const char* name, const DeviceIntegration& integration, double ticksPerSecond, bool headingResetDone)
+{
+	strncpy(checkpoint.bluetoothAddress, name, sizeof(checkpoint.bluetoothAddress) - 1);
+	checkpoint.headingResetDone = headingResetDone;
+	checkpoint.lastSampleTimeFine = integration.lastSampleTimeFine;
+	checkpoint.sampleTime = sampleTime(integration, ticksPerSecond);
+	checkpoint.state = integration.filter.state();
+	checkpoint.covariance = integration.filter.covariance();
+}
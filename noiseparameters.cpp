@@ -0,0 +1,61 @@
+#include "noiseparameters.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+const char* const NOISE_HEADER = "BluetoothAddress,GyroNoise,AccelerationNoise,GyroBiasRandomWalk,AccelerationBiasRandomWalk";
+}
+
+/*! \brief Read per-device noise settings
+	\details Rows that cannot be parsed are skipped. Settings that are not in the file, such as the
+	initial uncertainties, keep their default values.
+	\param fileName The noise parameter file
+	\param noise Receives the settings per bluetooth address, existing entries are replaced
+	\returns False if the file could not be opened
+*/
+bool loadNoiseParameters(const string& fileName, map<string, FilterNoise>& noise)
+{
+	ifstream file(fileName);
+	if (!file)
+		return false;
+
+	string line;
+	while (getline(file, line))
+	{
+		if (line.empty() || line.compare(0, 16, "BluetoothAddress") == 0)
+			continue;
+
+		stringstream fields(line);
+		string address;
+		FilterNoise device;
+		char comma[4];
+		if (getline(fields, address, ',')
+			&& fields >> device.gyroNoise >> comma[0] >> device.accelerationNoise >> comma[1]
+				>> device.gyroBiasRandomWalk >> comma[2] >> device.accelerationBiasRandomWalk)
+			noise[address] = device;
+	}
+	return true;
+}
+
+/*! \brief Write per-device noise settings
+	\param fileName The noise parameter file, it is overwritten
+	\param noise The settings per bluetooth address
+	\returns False if the file could not be written
+*/
+bool saveNoiseParameters(const string& fileName, const map<string, FilterNoise>& noise)
+{
+	ofstream file(fileName);
+	if (!file)
+		return false;
+
+	file << NOISE_HEADER << "\n" << scientific << setprecision(6);
+	for (auto const& device : noise)
+		file << device.first << "," << device.second.gyroNoise << "," << device.second.accelerationNoise
+			<< "," << device.second.gyroBiasRandomWalk << "," << device.second.accelerationBiasRandomWalk << "\n";
+	return static_cast<bool>(file.flush());
+}
@@ -0,0 +1,17 @@
+#ifndef NOISE_PARAMETERS_H
+#define NOISE_PARAMETERS_H
+
+#include "errorstatefilter.h"
+
+#include <map>
+#include <string>
+
+/*	Per-device filter noise settings, stored as a CSV file with one row per device:
+	BluetoothAddress,GyroNoise,AccelerationNoise,GyroBiasRandomWalk,AccelerationBiasRandomWalk
+	The allandev tool writes it from static recordings, main loads it at startup.
+*/
+
+bool loadNoiseParameters(const std::string& fileName, std::map<std::string, FilterNoise>& noise);
+bool saveNoiseParameters(const std::string& fileName, const std::map<std::string, FilterNoise>& noise);
+
+#endif
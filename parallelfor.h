@@ -0,0 +1,47 @@
+#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/*! \brief Call \a function(i) for every i in [0, count) on all cores
+	\details Indices are handed out one at a time from a shared counter, so tasks of very different
+	cost still keep every thread busy. Returns when all calls are done. \a function must be safe to
+	call concurrently for different indices.
+	\param count The number of tasks
+	\param function The task, called with the task index
+	\param threads The number of threads to use, 0 for one per core
+*/
+template <class Function>
+void parallelFor(size_t count, Function function, unsigned threads = 0)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+			function(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+			function(i);
+	};
+
+	std::vector<std::thread> pool;
+	pool.reserve(threads - 1);
+	for (unsigned t = 1; t < threads; ++t)
+		pool.emplace_back(worker);
+	worker();
+	for (auto& thread : pool)
+		thread.join();
+}
+
+#endif
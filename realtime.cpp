@@ -0,0 +1,298 @@
+#include "realtime.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace
+{
+const int64_t NS_PER_SECOND = 1000000000;
+
+int64_t toNs(const timespec& time)
+{
+	return time.tv_sec * NS_PER_SECOND + time.tv_nsec;
+}
+
+timespec fromNs(int64_t ns)
+{
+	timespec time;
+	time.tv_sec = ns / NS_PER_SECOND;
+	time.tv_nsec = ns % NS_PER_SECOND;
+	return time;
+}
+
+int64_t monotonicNs()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return toNs(now);
+}
+
+//! Touches a block of stack, so its pages are mapped (and locked) before the time critical part starts
+void prefaultStack(size_t bytes)
+{
+	volatile char* stack = static_cast<volatile char*>(alloca(bytes));
+	for (size_t i = 0; i < bytes; i += 4096)
+		stack[i] = 0;
+}
+}
+
+/*! \brief Lock all current and future memory of the process into RAM and prefault the heap and stack
+	\details The heap is kept from returning memory to the system and from using separate mappings
+	for large blocks, so memory that was prefaulted once stays mapped and later allocations of up to
+	\a prefaultHeapBytes do not page fault.
+	\param prefaultHeapBytes The amount of heap to touch up front
+	\param prefaultStackBytes The amount of stack of the calling thread to touch up front
+	\returns False if the memory could not be locked, it is still prefaulted then
+*/
+bool lockProcessMemory(size_t prefaultHeapBytes, size_t prefaultStackBytes)
+{
+	bool locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+	if (!locked)
+		cout << "Real-time: could not lock memory (" << strerror(errno)
+			<< "), needs CAP_IPC_LOCK or a higher memlock limit (ulimit -l). Continuing with pageable memory." << endl;
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (prefaultHeapBytes)
+	{
+		char* heap = static_cast<char*>(malloc(prefaultHeapBytes));
+		if (heap)
+		{
+			for (size_t i = 0; i < prefaultHeapBytes; i += 4096)
+				heap[i] = 0;
+			free(heap);
+		}
+	}
+	if (prefaultStackBytes)
+		prefaultStack(prefaultStackBytes);
+	return locked;
+}
+
+/*! \brief Pin the calling thread to a set of cores and optionally give it a SCHED_FIFO priority
+	\param name The name of the thread in warnings
+	\param cpus The cores to run on, empty to leave the affinity alone
+	\param fifoPriority The SCHED_FIFO priority from 1 to 99, 0 to keep the normal scheduler
+	\returns False if either step failed, the thread continues with its previous settings for that step
+*/
+bool setThreadRealtime(const char* name, const vector<int>& cpus, int fifoPriority)
+{
+	bool ok = true;
+	if (!cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus)
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+
+		int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (result != 0)
+		{
+			cout << "Real-time: could not pin the " << name << " thread (" << strerror(result) << "), it runs on any core." << endl;
+			ok = false;
+		}
+	}
+
+	if (fifoPriority > 0)
+	{
+		sched_param param = {};
+		param.sched_priority = min(fifoPriority, sched_get_priority_max(SCHED_FIFO));
+		int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (result != 0)
+		{
+			cout << "Real-time: could not give the " << name << " thread SCHED_FIFO priority " << param.sched_priority
+				<< " (" << strerror(result) << "), needs CAP_SYS_NICE or an rtprio limit. It keeps the normal scheduler." << endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/*! \brief Let the calling thread run on any core with the normal scheduler
+	\details For background work started from a real-time thread, which would otherwise inherit its
+	core and priority and pass them on to the threads it starts itself
+	\param name The name of the thread in warnings
+	\returns False if either step failed
+*/
+bool setThreadNormal(const char* name)
+{
+	bool ok = true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		CPU_SET(cpu, &set);
+	int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (result != 0)
+	{
+		cout << "Real-time: could not unpin the " << name << " thread (" << strerror(result) << ")." << endl;
+		ok = false;
+	}
+
+	sched_param param = {};
+	result = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	if (result != 0)
+	{
+		cout << "Real-time: could not give the " << name << " thread the normal scheduler (" << strerror(result) << ")." << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+/*! \brief Parse a core list such as "2,3" or "4-7"
+	\returns The cores, empty for an empty or invalid list
+*/
+vector<int> parseCpuList(const string& text)
+{
+	vector<int> cpus;
+	stringstream ranges(text);
+	string range;
+	while (getline(ranges, range, ','))
+	{
+		int first, last;
+		char dash;
+		stringstream parts(range);
+		if (!(parts >> first))
+			return vector<int>();
+		if (parts >> dash >> last && dash == '-')
+		{
+			for (int cpu = first; cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+		}
+		else
+			cpus.push_back(first);
+	}
+	return cpus;
+}
+
+/*! \brief Constructor */
+LatencyHistogram::LatencyHistogram()
+	: m_buckets(Buckets)
+{
+	clear();
+}
+
+/*! \brief Add a latency sample
+	\param latencyUs The latency in microseconds, negative values count as 0
+*/
+void LatencyHistogram::add(int64_t latencyUs)
+{
+	latencyUs = std::max<int64_t>(latencyUs, 0);
+	++m_buckets[std::min<size_t>(static_cast<size_t>(latencyUs), Buckets - 1)];
+	m_min = m_count ? std::min(m_min, latencyUs) : latencyUs;
+	m_max = m_count ? std::max(m_max, latencyUs) : latencyUs;
+	m_sum += latencyUs;
+	++m_count;
+}
+
+/*! \brief Remove all samples */
+void LatencyHistogram::clear()
+{
+	fill(m_buckets.begin(), m_buckets.end(), 0);
+	m_count = 0;
+	m_min = 0;
+	m_max = 0;
+	m_sum = 0.0;
+}
+
+/*! \returns The number of samples */
+uint64_t LatencyHistogram::count() const
+{
+	return m_count;
+}
+
+/*! \returns The smallest latency in us */
+int64_t LatencyHistogram::min() const
+{
+	return m_min;
+}
+
+/*! \returns The largest latency in us, exact also above the histogram range */
+int64_t LatencyHistogram::max() const
+{
+	return m_max;
+}
+
+/*! \returns The mean latency in us */
+double LatencyHistogram::mean() const
+{
+	return m_count ? m_sum / m_count : 0.0;
+}
+
+/*! \returns The latency in us below which a fraction \a p of the samples lies, capped at 10 ms
+	\param p The fraction, for example 0.999
+*/
+int64_t LatencyHistogram::percentile(double p) const
+{
+	uint64_t target = static_cast<uint64_t>(p * m_count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < Buckets; ++i)
+	{
+		seen += m_buckets[i];
+		if (seen > target)
+			return static_cast<int64_t>(i);
+	}
+	return m_max;
+}
+
+/*! \brief Constructor, the first deadline is one period from now
+	\param periodUs The period in microseconds
+*/
+CycleTimer::CycleTimer(int64_t periodUs)
+	: m_periodNs(max<int64_t>(periodUs, 1) * 1000)
+	, m_next(fromNs(monotonicNs() + m_periodNs))
+	, m_overruns(0)
+{
+}
+
+/*! \brief Sleep until the next deadline and record the wake-up latency */
+void CycleTimer::wait()
+{
+	int64_t now = monotonicNs();
+	int64_t deadline = toNs(m_next);
+	if (now > deadline)
+	{
+		// The previous cycle did not finish in time, start over instead of running back to back
+		m_overruns += 1 + static_cast<uint64_t>((now - deadline) / m_periodNs);
+		deadline = now + m_periodNs;
+		m_next = fromNs(deadline);
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &m_next, nullptr) == EINTR)
+		;
+	m_latency.add((monotonicNs() - deadline) / 1000);
+	m_next = fromNs(deadline + m_periodNs);
+}
+
+/*! \returns The wake-up latencies so far */
+const LatencyHistogram& CycleTimer::latency() const
+{
+	return m_latency;
+}
+
+/*! \returns The number of deadlines that were missed because a cycle took too long */
+uint64_t CycleTimer::overruns() const
+{
+	return m_overruns;
+}
+
+/*! \returns A one-line summary of the wake-up latencies */
+string CycleTimer::report() const
+{
+	stringstream text;
+	text << "Scheduling latency over " << m_latency.count() << " cycles of " << m_periodNs / 1000 << " us: min "
+		<< m_latency.min() << " us, mean " << static_cast<int64_t>(m_latency.mean()) << " us, p99 " << m_latency.percentile(0.99)
+		<< " us, p99.9 " << m_latency.percentile(0.999) << " us, max " << m_latency.max() << " us, " << m_overruns << " overrun(s)";
+	return text.str();
+}
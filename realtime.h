@@ -0,0 +1,69 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/*	Real-time execution support. Every function degrades gracefully: when the process lacks the
+	privilege for a step (CAP_SYS_NICE or an rtprio limit for SCHED_FIFO, CAP_IPC_LOCK or a memlock
+	limit for mlockall) it prints a warning, skips the step and returns false, and the program
+	continues as a normal process.
+*/
+
+bool lockProcessMemory(size_t prefaultHeapBytes, size_t prefaultStackBytes);
+bool setThreadRealtime(const char* name, const std::vector<int>& cpus, int fifoPriority);
+bool setThreadNormal(const char* name);
+std::vector<int> parseCpuList(const std::string& text);
+
+/*! \brief Histogram of latencies with 1 us resolution up to 10 ms */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void add(int64_t latencyUs);
+	void clear();
+
+	uint64_t count() const;
+	int64_t min() const;
+	int64_t max() const;
+	double mean() const;
+	int64_t percentile(double p) const;
+
+private:
+	static const size_t Buckets = 10000;
+
+	std::vector<uint64_t> m_buckets;	//!< The last bucket also holds everything above 10 ms
+	uint64_t m_count;
+	int64_t m_min;
+	int64_t m_max;
+	double m_sum;
+};
+
+/*! \brief Sleeps until fixed-period deadlines and records how late each wake-up is
+	\details The wake-up latency is the scheduling latency of the calling thread, like cyclictest
+	measures it. When processing runs past a deadline the missed deadlines are counted as overruns
+	and the schedule restarts from the current time, instead of rushing to catch up.
+*/
+class CycleTimer
+{
+public:
+	explicit CycleTimer(int64_t periodUs);
+
+	void wait();
+
+	const LatencyHistogram& latency() const;
+	uint64_t overruns() const;
+	std::string report() const;
+
+private:
+	int64_t m_periodNs;
+	timespec m_next;
+	LatencyHistogram m_latency;
+	uint64_t m_overruns;
+};
+
+#endif
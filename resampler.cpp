@@ -0,0 +1,385 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+/*! \brief Extends a raw SampleTimeFine value with the number of counter wraps seen so far
+	\param sampleTimeFine The raw 32-bit SampleTimeFine of the packet
+	\returns The monotonic 64-bit sample time, in the same units as SampleTimeFine
+*/
+int64_t SampleTimeUnwrapper::unwrap(uint32_t sampleTimeFine)
+{
+	if (!m_started)
+	{
+		m_started = true;
+		m_extended = sampleTimeFine;
+	}
+	else
+		m_extended += static_cast<uint32_t>(sampleTimeFine - m_last);
+	m_last = sampleTimeFine;
+	return m_extended;
+}
+
+/*! \brief Forget the previous counter value, the next sample starts a new sequence */
+void SampleTimeUnwrapper::reset()
+{
+	m_started = false;
+	m_last = 0;
+	m_extended = 0;
+}
+
+/*! \brief Constructor
+	\param forgettingFactor Weight decay per observation, closer to 1 averages over a longer history
+*/
+ClockModel::ClockModel(double forgettingFactor)
+	: m_forgettingFactor(forgettingFactor)
+{
+}
+
+/*! \brief Discard all observations */
+void ClockModel::reset()
+{
+	*this = ClockModel(m_forgettingFactor);
+}
+
+/*! \brief Add a pair of device sample time and host arrival time to the fit
+	\param deviceTimeUs The unwrapped device sample time in microseconds
+	\param hostTimeMs The host time at which the sample arrived, as returned by XsTime::timeStampNow()
+*/
+void ClockModel::addObservation(int64_t deviceTimeUs, int64_t hostTimeMs)
+{
+	if (m_observations == 0)
+	{
+		m_originDeviceUs = deviceTimeUs;
+		m_originHostMs = hostTimeMs;
+	}
+
+	// Fit the deviation from a nominal 1:1 rate, which keeps the sums well conditioned
+	double x = (deviceTimeUs - m_originDeviceUs) / 1000.0;
+	double y = (hostTimeMs - m_originHostMs) - x;
+
+	m_sw = m_forgettingFactor * m_sw + 1.0;
+	m_sx = m_forgettingFactor * m_sx + x;
+	m_sy = m_forgettingFactor * m_sy + y;
+	m_sxx = m_forgettingFactor * m_sxx + x * x;
+	m_sxy = m_forgettingFactor * m_sxy + x * y;
+	++m_observations;
+
+	double det = m_sw * m_sxx - m_sx * m_sx;
+	if (m_observations >= 2 && det > 1e-9 * m_sw * m_sxx)
+	{
+		m_drift = (m_sw * m_sxy - m_sx * m_sy) / det;
+		m_offset = (m_sy - m_drift * m_sx) / m_sw;
+	}
+	else
+	{
+		m_drift = 0.0;
+		m_offset = m_sy / m_sw;
+	}
+}
+
+/*! \returns The estimated host time in milliseconds belonging to a device sample time
+	\param deviceTimeUs The unwrapped device sample time in microseconds
+*/
+double ClockModel::toHostMs(int64_t deviceTimeUs) const
+{
+	double x = (deviceTimeUs - m_originDeviceUs) / 1000.0;
+	return m_originHostMs + x + m_offset + m_drift * x;
+}
+
+/*! \returns The estimated device sample time in microseconds belonging to a host time
+	\param hostTimeMs The host time in milliseconds
+*/
+double ClockModel::toDeviceUs(double hostTimeMs) const
+{
+	double x = (hostTimeMs - m_originHostMs - m_offset) / (1.0 + m_drift);
+	return m_originDeviceUs + 1000.0 * x;
+}
+
+/*! \returns The estimated offset in milliseconds between the device clock and the host clock at the first observation */
+double ClockModel::offsetMs() const
+{
+	return m_offset;
+}
+
+/*! \returns The estimated rate difference of the device clock relative to the host clock, in parts per million */
+double ClockModel::driftPpm() const
+{
+	return 1e6 * m_drift;
+}
+
+/*! \returns The number of observations added since the last reset */
+size_t ClockModel::observations() const
+{
+	return m_observations;
+}
+
+/*! \brief Spherical linear interpolation of a batch of quaternion pairs
+	\details All inputs are processed in one branch-light loop so the compiler can keep the
+	trigonometry in flight for several devices at once. Nearly identical pairs fall back to a
+	normalized linear interpolation.
+	\param from The start quaternions
+	\param to The end quaternions
+	\param fraction The interpolation fractions, 0 returns \a from and 1 returns \a to
+	\param result Receives \a count interpolated unit quaternions
+	\param count The number of quaternion pairs
+*/
+void slerpBatch(const Quat* from, const Quat* to, const double* fraction, Quat* result, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Quat& a = from[i];
+		const Quat& b = to[i];
+		double t = fraction[i];
+
+		double c = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+		double sign = c < 0.0 ? -1.0 : 1.0;
+		c *= sign;
+
+		double wa = 1.0 - t;
+		double wb = t;
+		if (c < 0.9995)
+		{
+			double theta = acos(c);
+			double invSin = 1.0 / sin(theta);
+			wa = sin(wa * theta) * invSin;
+			wb = sin(wb * theta) * invSin;
+		}
+		wb *= sign;
+
+		result[i] = quatNormalized({
+			wa * a.w + wb * b.w,
+			wa * a.x + wb * b.x,
+			wa * a.y + wb * b.y,
+			wa * a.z + wb * b.z
+		});
+	}
+}
+
+/*! \brief Constructor
+	\param deviceCount The number of devices to align, devices are addressed by index
+	\param outputRateHz The rate of the common output timeline
+	\param ticksPerSecond The number of SampleTimeFine ticks per second
+	\param historyLength The number of samples kept per device for interpolation
+	\param staleTimeoutMs A device that has not delivered data for this long no longer holds back the timeline
+*/
+TimelineResampler::TimelineResampler(size_t deviceCount, double outputRateHz, double ticksPerSecond,
+	size_t historyLength, double staleTimeoutMs)
+	: m_streams(deviceCount)
+	, m_periodMs(1000.0 / outputRateHz)
+	, m_ticksPerSecond(ticksPerSecond)
+	, m_staleTimeoutMs(staleTimeoutMs)
+	, m_from(deviceCount)
+	, m_to(deviceCount)
+	, m_fraction(deviceCount)
+{
+	assert(historyLength >= 2);
+	for (auto& stream : m_streams)
+		stream.ring.resize(historyLength);
+}
+
+/*! \brief Add a delta quantities sample of a device
+	\details The increments are accumulated into the device's integrated orientation and
+	velocity, which are the quantities that are interpolated. The first sample of a device
+	only anchors its stream.
+	\param device The index of the device
+	\param sampleTimeFine The SampleTimeFine of the packet
+	\param hostTimeMs The host time at which the packet arrived
+	\param dq The orientation increment of the packet
+	\param dv The velocity increment of the packet, in the sensor frame
+*/
+void TimelineResampler::addSample(size_t device, uint32_t sampleTimeFine, int64_t hostTimeMs, const Quat& dq, const Vec3& dv)
+{
+	DeviceStream& stream = m_streams[device];
+
+	int64_t deviceTimeUs = llround(stream.unwrapper.unwrap(sampleTimeFine) * (1e6 / m_ticksPerSecond));
+	stream.clock.addObservation(deviceTimeUs, hostTimeMs);
+	stream.lastArrivalMs = hostTimeMs;
+
+	if (stream.started)
+	{
+		stream.velocity = stream.velocity + quatRotate(stream.orientation, dv);
+		stream.orientation = quatNormalized(quatMultiply(stream.orientation, dq));
+	}
+	else
+	{
+		stream.firstArrivalMs = hostTimeMs;
+		stream.started = true;
+	}
+
+	size_t capacity = stream.ring.size();
+	if (stream.count == capacity)
+	{
+		stream.head = (stream.head + 1) % capacity;
+		--stream.count;
+	}
+	stream.ring[(stream.head + stream.count) % capacity] = { deviceTimeUs, stream.orientation, stream.velocity };
+	++stream.count;
+}
+
+/*! \brief Produce the next frame of the common timeline when all active devices have data for it
+	\details Devices that are stale or have not delivered any data yet are marked invalid in the frame.
+	When a device becomes valid again, its first increments span the whole gap, so integrating the
+	frame increments never loses motion.
+	\param frame Receives the frame, its arrays are sized to the number of devices
+	\param hostTimeNowMs The current host time, used to detect stale devices
+	\returns True if a frame was produced
+*/
+bool TimelineResampler::nextFrame(ResampledFrame& frame, int64_t hostTimeNowMs)
+{
+	if (!m_timelineStarted && !startTimeline(hostTimeNowMs))
+		return false;
+
+	double t = m_nextTimeMs;
+	size_t deviceCount = m_streams.size();
+
+	// All active devices must have a sample at or after t before the frame can be interpolated
+	for (auto const& stream : m_streams)
+	{
+		if (!stream.started)
+			continue;
+		const Knot& newest = knot(stream, stream.count - 1);
+		if (stream.clock.toHostMs(newest.deviceTimeUs) < t && !isStale(stream, hostTimeNowMs))
+			return false;
+	}
+
+	frame.hostTimeMs = t;
+	frame.valid.assign(deviceCount, 0);
+	frame.orientation.resize(deviceCount);
+	frame.dq.resize(deviceCount);
+	frame.dv.resize(deviceCount);
+
+	size_t batch = 0;
+	for (size_t d = 0; d < deviceCount; ++d)
+	{
+		DeviceStream& stream = m_streams[d];
+		if (!stream.started)
+			continue;
+
+		double deviceTimeUs = stream.clock.toDeviceUs(t);
+		if (knot(stream, stream.count - 1).deviceTimeUs < deviceTimeUs)
+			continue;
+
+		// Find the bracketing pair and drop the samples before it, they are not needed anymore
+		size_t lower = 0;
+		while (lower + 1 < stream.count && knot(stream, lower + 1).deviceTimeUs <= deviceTimeUs)
+			++lower;
+		size_t upper = min(lower + 1, stream.count - 1);
+
+		const Knot& a = knot(stream, lower);
+		const Knot& b = knot(stream, upper);
+		double span = static_cast<double>(b.deviceTimeUs - a.deviceTimeUs);
+		double fraction = span > 0.0 ? (deviceTimeUs - a.deviceTimeUs) / span : 0.0;
+		fraction = min(max(fraction, 0.0), 1.0);
+
+		m_from[batch] = a.orientation;
+		m_to[batch] = b.orientation;
+		m_fraction[batch] = fraction;
+		frame.dv[d] = a.velocity + (b.velocity - a.velocity) * fraction;
+		frame.valid[d] = 1;
+		++batch;
+
+		stream.head = (stream.head + lower) % stream.ring.size();
+		stream.count -= lower;
+	}
+
+	slerpBatch(m_from.data(), m_to.data(), m_fraction.data(), m_from.data(), batch);
+
+	batch = 0;
+	for (size_t d = 0; d < deviceCount; ++d)
+	{
+		if (!frame.valid[d])
+			continue;
+
+		DeviceStream& stream = m_streams[d];
+		Quat orientation = m_from[batch++];
+		Vec3 velocity = frame.dv[d];
+
+		frame.orientation[d] = orientation;
+		if (stream.emitted)
+		{
+			Quat inverse = quatConjugate(stream.lastOrientation);
+			frame.dq[d] = quatNormalized(quatMultiply(inverse, orientation));
+			frame.dv[d] = quatRotate(inverse, velocity - stream.lastVelocity);
+		}
+		else
+		{
+			frame.dq[d] = Quat();
+			frame.dv[d] = Vec3();
+		}
+
+		stream.emitted = true;
+		stream.lastOrientation = orientation;
+		stream.lastVelocity = velocity;
+	}
+
+	m_nextTimeMs += m_periodMs;
+	return true;
+}
+
+/*! \returns The number of devices this resampler aligns */
+size_t TimelineResampler::deviceCount() const
+{
+	return m_streams.size();
+}
+
+/*! \returns The rate of the output timeline in Hz */
+double TimelineResampler::outputRate() const
+{
+	return 1000.0 / m_periodMs;
+}
+
+/*! \returns The clock model estimated for a device
+	\param device The index of the device
+*/
+const ClockModel& TimelineResampler::clockModel(size_t device) const
+{
+	return m_streams[device].clock;
+}
+
+/*! \returns The sample at position \a index in the history of \a stream, 0 being the oldest */
+const TimelineResampler::Knot& TimelineResampler::knot(const DeviceStream& stream, size_t index) const
+{
+	return stream.ring[(stream.head + index) % stream.ring.size()];
+}
+
+/*! \returns True if \a stream has not received any data for longer than the stale timeout */
+bool TimelineResampler::isStale(const DeviceStream& stream, int64_t hostTimeNowMs) const
+{
+	return hostTimeNowMs - stream.lastArrivalMs > m_staleTimeoutMs;
+}
+
+/*! \brief Determine the first time of the output timeline
+	\details The timeline starts at the latest first sample of all devices, or of the devices that
+	have started when the others have not delivered anything within the stale timeout.
+	\returns True if the timeline has started
+*/
+bool TimelineResampler::startTimeline(int64_t hostTimeNowMs)
+{
+	bool allStarted = true;
+	bool anyStarted = false;
+	int64_t firstArrivalMs = hostTimeNowMs;
+	double startMs = 0.0;
+	for (auto const& stream : m_streams)
+	{
+		if (!stream.started)
+		{
+			allStarted = false;
+			continue;
+		}
+		double first = stream.clock.toHostMs(knot(stream, 0).deviceTimeUs);
+		startMs = anyStarted ? max(startMs, first) : first;
+		firstArrivalMs = min(firstArrivalMs, stream.firstArrivalMs);
+		anyStarted = true;
+	}
+
+	if (!anyStarted || (!allStarted && hostTimeNowMs - firstArrivalMs <= m_staleTimeoutMs))
+		return false;
+
+	m_nextTimeMs = startMs;
+	m_timelineStarted = true;
+	return true;
+}
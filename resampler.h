@@ -0,0 +1,122 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "imumath.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*! \brief Extends the 32-bit SampleTimeFine counter of a device into a monotonic 64-bit counter */
+class SampleTimeUnwrapper
+{
+public:
+	int64_t unwrap(uint32_t sampleTimeFine);
+	void reset();
+
+private:
+	bool m_started = false;
+	uint32_t m_last = 0;
+	int64_t m_extended = 0;
+};
+
+/*! \brief Online estimate of the mapping from a device clock to host time
+	\details Fits hostTime = origin + deviceTime + offset + drift * deviceTime with an exponentially
+	weighted least squares fit, so the estimate keeps following slow changes of the device oscillator.
+	The mean transport latency ends up in the offset, which is common to all devices on the same host.
+*/
+class ClockModel
+{
+public:
+	explicit ClockModel(double forgettingFactor = 0.999);
+
+	void reset();
+	void addObservation(int64_t deviceTimeUs, int64_t hostTimeMs);
+	double toHostMs(int64_t deviceTimeUs) const;
+	double toDeviceUs(double hostTimeMs) const;
+	double offsetMs() const;
+	double driftPpm() const;
+	size_t observations() const;
+
+private:
+	double m_forgettingFactor;
+	size_t m_observations = 0;
+	int64_t m_originDeviceUs = 0;
+	int64_t m_originHostMs = 0;
+	double m_sw = 0.0;
+	double m_sx = 0.0;
+	double m_sy = 0.0;
+	double m_sxx = 0.0;
+	double m_sxy = 0.0;
+	double m_offset = 0.0;
+	double m_drift = 0.0;
+};
+
+/*! \brief One step of the common timeline, with the increments of every device over the last output period */
+struct ResampledFrame
+{
+	double hostTimeMs = 0.0;
+	std::vector<uint8_t> valid;
+	std::vector<Quat> orientation;
+	std::vector<Quat> dq;
+	std::vector<Vec3> dv;
+};
+
+void slerpBatch(const Quat* from, const Quat* to, const double* fraction, Quat* result, size_t count);
+
+/*! \brief Resamples the dq/dv streams of several devices onto one fixed-rate host timeline */
+class TimelineResampler
+{
+public:
+	TimelineResampler(size_t deviceCount, double outputRateHz, double ticksPerSecond,
+		size_t historyLength = 64, double staleTimeoutMs = 500.0);
+
+	void addSample(size_t device, uint32_t sampleTimeFine, int64_t hostTimeMs, const Quat& dq, const Vec3& dv);
+	bool nextFrame(ResampledFrame& frame, int64_t hostTimeNowMs);
+
+	size_t deviceCount() const;
+	double outputRate() const;
+	const ClockModel& clockModel(size_t device) const;
+
+private:
+	struct Knot
+	{
+		int64_t deviceTimeUs;
+		Quat orientation;
+		Vec3 velocity;
+	};
+
+	struct DeviceStream
+	{
+		SampleTimeUnwrapper unwrapper;
+		ClockModel clock;
+		std::vector<Knot> ring;
+		size_t head = 0;
+		size_t count = 0;
+		Quat orientation;
+		Vec3 velocity;
+		int64_t firstArrivalMs = 0;
+		int64_t lastArrivalMs = 0;
+		bool started = false;
+		bool emitted = false;
+		Quat lastOrientation;
+		Vec3 lastVelocity;
+	};
+
+	const Knot& knot(const DeviceStream& stream, size_t index) const;
+	bool isStale(const DeviceStream& stream, int64_t hostTimeNowMs) const;
+	bool startTimeline(int64_t hostTimeNowMs);
+
+	std::vector<DeviceStream> m_streams;
+	double m_periodMs;
+	double m_ticksPerSecond;
+	double m_staleTimeoutMs;
+	bool m_timelineStarted = false;
+	double m_nextTimeMs = 0.0;
+
+	std::vector<Quat> m_from;
+	std::vector<Quat> m_to;
+	std::vector<double> m_fraction;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*! \brief Bounded lock-free queue for exactly one producer thread and one consumer thread
+	\details The capacity is rounded up to a power of two. The head and tail counters live on
+	separate cache lines so the two threads do not contend on them.
+*/
+template <class T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity)
+		: m_mask(roundUp(capacity) - 1)
+		, m_items(m_mask + 1)
+		, m_head(0)
+		, m_tail(0)
+	{
+	}
+
+	//! Append an item, producer thread only. Returns false if the queue is full
+	bool push(const T& item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+			return false;
+		m_items[tail & m_mask] = item;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! Remove the oldest item, consumer thread only. Returns false if the queue is empty
+	bool pop(T& item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+		item = m_items[head & m_mask];
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! The number of queued items, exact only when called from one of the two threads
+	size_t size() const
+	{
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	static size_t roundUp(size_t capacity)
+	{
+		size_t result = 1;
+		while (result < capacity)
+			result <<= 1;
+		return result;
+	}
+
+	const size_t m_mask;
+	std::vector<T> m_items;
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_tail;
+};
+
+#endif
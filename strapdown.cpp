@@ -0,0 +1,60 @@
+#include "strapdown.h"
+
+#include <cmath>
+
+using namespace std;
+
+/*! \brief Restart the integration from \a state */
+void StrapdownIntegrator::reset(const NavigationState& state)
+{
+	m_state = state;
+	m_acceleration = Vec3();
+}
+
+/*! \brief Integrate one delta quantities sample
+	\details The velocity increment is rotated to the navigation frame with the attitude halfway
+	the sample interval, gravity is removed and the position is integrated with the trapezoidal rule.
+	\param dq The orientation increment of the sample
+	\param dv The velocity increment of the sample, in the sensor frame
+	\param dt The sample interval in seconds
+*/
+void StrapdownIntegrator::propagate(const Quat& dq, const Vec3& dv, double dt)
+{
+	Quat halfway = quatMultiply(m_state.attitude, quatFromRotationVector(quatToRotationVector(dq) * 0.5));
+	Vec3 dvNav = quatRotate(halfway, dv);
+	dvNav.z -= GRAVITY * dt;
+
+	Vec3 previousVelocity = m_state.velocity;
+	m_state.velocity = m_state.velocity + dvNav;
+	m_state.position = m_state.position + (previousVelocity + m_state.velocity) * (0.5 * dt);
+	m_state.attitude = quatNormalized(quatMultiply(m_state.attitude, dq));
+	m_acceleration = dt > 0.0 ? dvNav * (1.0 / dt) : Vec3();
+}
+
+/*! \returns The current integrated navigation state */
+const NavigationState& StrapdownIntegrator::state() const
+{
+	return m_state;
+}
+
+/*! \returns The gravity compensated acceleration in the navigation frame over the last sample */
+Vec3 StrapdownIntegrator::acceleration() const
+{
+	return m_acceleration;
+}
+
+/*! \returns True if a sample indicates the device is at rest
+	\param dq The orientation increment of the sample
+	\param dv The velocity increment of the sample
+	\param dt The sample interval in seconds
+	\param gyroThreshold The maximum angular rate in rad/s
+	\param accelerationThreshold The maximum deviation of the specific force from gravity in m/s^2
+*/
+bool isStationary(const Quat& dq, const Vec3& dv, double dt, double gyroThreshold, double accelerationThreshold)
+{
+	if (dt <= 0.0)
+		return false;
+	double rate = norm(quatToRotationVector(dq)) / dt;
+	double specificForce = norm(dv) / dt;
+	return rate < gyroThreshold && fabs(specificForce - GRAVITY) < accelerationThreshold;
+}
@@ -0,0 +1,34 @@
+#ifndef STRAPDOWN_H
+#define STRAPDOWN_H
+
+#include "imumath.h"
+
+//! Standard gravity in m/s^2, the navigation frame has Z pointing up
+const double GRAVITY = 9.80665;
+
+/*! \brief Attitude, velocity and position of a device in the navigation frame */
+struct NavigationState
+{
+	Quat attitude;
+	Vec3 velocity;
+	Vec3 position;
+};
+
+/*! \brief Integrates the dq/dv delta quantities of one device into attitude, velocity and position */
+class StrapdownIntegrator
+{
+public:
+	void reset(const NavigationState& state = NavigationState());
+	void propagate(const Quat& dq, const Vec3& dv, double dt);
+
+	const NavigationState& state() const;
+	Vec3 acceleration() const;
+
+private:
+	NavigationState m_state;
+	Vec3 m_acceleration;
+};
+
+bool isStationary(const Quat& dq, const Vec3& dv, double dt, double gyroThreshold = 0.05, double accelerationThreshold = 0.3);
+
+#endif
@@ -0,0 +1,74 @@
+#include "tracing.h"
+
+#ifdef ENABLE_TRACING
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+// Buffers outlive their threads, so spans of threads that already ended are still flushed
+mutex g_registryMutex;
+vector<unique_ptr<TraceBuffer>> g_buffers;
+}
+
+thread_local TraceBuffer* Tracing::t_buffer = nullptr;
+
+/*! \brief Create the trace buffer of the calling thread, happens once per thread
+	\returns The buffer of the calling thread
+*/
+TraceBuffer* Tracing::registerThread()
+{
+	lock_guard<mutex> lock(g_registryMutex);
+	g_buffers.emplace_back(new TraceBuffer);
+	t_buffer = g_buffers.back().get();
+
+	// Touch the whole buffer now, so recording a span never takes a page fault
+	memset(t_buffer->events, 0, sizeof(t_buffer->events));
+	t_buffer->threadId = static_cast<uint32_t>(g_buffers.size());
+	return t_buffer;
+}
+
+/*! \brief Write the recorded spans of all threads as a Chrome trace JSON file
+	\details The spans of each thread are written oldest first, starting after the wrapped-around
+	part of its ring. Spans that are recorded while flushing may or may not end up in the file.
+	\param fileName The file to write
+	\returns False if the file could not be written
+*/
+bool Tracing::flush(const char* fileName)
+{
+	FILE* file = fopen(fileName, "w");
+	if (!file)
+		return false;
+
+	lock_guard<mutex> lock(g_registryMutex);
+	int pid = static_cast<int>(getpid());
+	bool first = true;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (auto const& buffer : g_buffers)
+	{
+		size_t count = buffer->count.load(memory_order_acquire);
+		size_t overwritten = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+		for (size_t i = overwritten; i < count; ++i)
+		{
+			const TraceEvent& e = buffer->events[i % TRACE_BUFFER_EVENTS];
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",\n", e.name, pid, buffer->threadId, e.startNs / 1000.0, e.durationNs / 1000.0);
+			first = false;
+		}
+
+		if (overwritten)
+			fprintf(stderr, "Trace buffer of thread %u wrapped, its %zu oldest spans were overwritten\n", buffer->threadId, overwritten);
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+/*	Low-overhead tracing spans, exported as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+	Build with "make TRACING=1" to enable them, otherwise every macro below expands to nothing.
+
+	TRACE_SPAN("name")				Records the duration of the enclosing scope
+	TRACE_SPAN_BEGIN(var, "name")	Starts a span that is ended explicitly by TRACE_SPAN_END(var)
+	TRACE_FLUSH("trace.json")		Writes all recorded spans of all threads, call at shutdown
+
+	Span names must be string literals, only the pointer is stored. Each thread keeps its last
+	TRACE_BUFFER_EVENTS spans in a ring, older spans are overwritten, so a stutter late in a long
+	session is still in the trace. Build with e.g. CXXFLAGS=-DTRACE_BUFFER_EVENTS=1048576 for a longer history.
+*/
+
+#ifdef ENABLE_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS (1 << 16)
+#endif
+
+struct TraceEvent
+{
+	const char* name;
+	int64_t startNs;
+	int64_t durationNs;
+};
+
+/*! \brief Ring of the most recent events of one thread, only ever written by that thread */
+struct TraceBuffer
+{
+	uint32_t threadId = 0;
+	std::atomic<size_t> count { 0 };	//!< Events recorded so far, the ring holds the last TRACE_BUFFER_EVENTS of them
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+namespace Tracing
+{
+TraceBuffer* registerThread();
+bool flush(const char* fileName);
+
+extern thread_local TraceBuffer* t_buffer;
+
+inline int64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*! \brief Append an event to the ring of the calling thread, overwriting the oldest one when full, without locking */
+inline void record(const char* name, int64_t startNs, int64_t endNs)
+{
+	TraceBuffer* buffer = t_buffer ? t_buffer : registerThread();
+	size_t count = buffer->count.load(std::memory_order_relaxed);
+	buffer->events[count % TRACE_BUFFER_EVENTS] = { name, startNs, endNs - startNs };
+	buffer->count.store(count + 1, std::memory_order_release);
+}
+}
+
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* name) : m_name(name), m_start(Tracing::now()) {}
+	~TraceSpan() { end(); }
+
+	void end()
+	{
+		if (!m_name)
+			return;
+		Tracing::record(m_name, m_start, Tracing::now());
+		m_name = nullptr;
+	}
+
+private:
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	const char* m_name;
+	int64_t m_start;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_SPAN_BEGIN(var, name) TraceSpan var(name)
+#define TRACE_SPAN_END(var) var.end()
+#define TRACE_FLUSH(fileName) Tracing::flush(fileName)
+
+#else
+
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_SPAN_BEGIN(var, name) ((void)0)
+#define TRACE_SPAN_END(var) ((void)0)
+#define TRACE_FLUSH(fileName) ((void)0)
+
+#endif
+
+#endif
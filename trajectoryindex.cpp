@@ -0,0 +1,544 @@
+#include "trajectoryindex.h"
+
+#include "csvlog.h"
+#include "errorstatefilter.h"
+#include "realtime.h"
+#include "resampler.h"
+#include "trajectorylod.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+const char INDEX_MAGIC[8] = { 'I', 'M', 'U', 'I', 'D', 'X', '1', '\0' };
+const uint32_t INDEX_VERSION = 1;
+const size_t NODE_CAPACITY = 16;
+
+struct IndexHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t samplesPerChunk;
+	char bluetoothAddress[24];
+	uint64_t sampleCount;
+	uint64_t chunkCount;
+};
+
+//! Replaces the extension of \a fileName, or appends \a extension if it has none
+string replaceExtension(const string& fileName, const char* extension)
+{
+	size_t dot = fileName.rfind('.');
+	size_t slash = fileName.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return fileName + extension;
+	return fileName.substr(0, dot) + extension;
+}
+
+/*	Sort-Tile-Recursive ordering: sort by the center along one dimension, cut into slabs that
+	hold a whole number of nodes and recurse into the next dimension within each slab. */
+template <class T>
+void strOrder(vector<T>& items, size_t begin, size_t end, int dim, int dims)
+{
+	if (dim == dims || end - begin <= NODE_CAPACITY)
+		return;
+
+	sort(items.begin() + begin, items.begin() + end, [dim](const T& a, const T& b) {
+		return a.box.min[dim] + a.box.max[dim] < b.box.min[dim] + b.box.max[dim];
+	});
+
+	size_t pages = (end - begin + NODE_CAPACITY - 1) / NODE_CAPACITY;
+	size_t slabs = static_cast<size_t>(ceil(pow(static_cast<double>(pages), 1.0 / (dims - dim))));
+	size_t slabSize = NODE_CAPACITY * ((pages + slabs - 1) / slabs);
+	for (size_t b = begin; b < end; b += slabSize)
+		strOrder(items, b, min(b + slabSize, end), dim + 1, dims);
+}
+}
+
+/*! \brief Constructor, an unrestricted query matching everything */
+TrajectoryQuery::TrajectoryQuery()
+	: startTime(-numeric_limits<double>::infinity())
+	, endTime(numeric_limits<double>::infinity())
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		min[i] = -numeric_limits<double>::infinity();
+		max[i] = numeric_limits<double>::infinity();
+	}
+}
+
+/*! \returns The name of the trajectory file stored next to a logfile */
+string trajectoryFileName(const string& logFileName)
+{
+	return replaceExtension(logFileName, ".traj");
+}
+
+/*! \returns The name of the index file stored next to a logfile */
+string indexFileName(const string& logFileName)
+{
+	return replaceExtension(logFileName, ".idx");
+}
+
+/*! \returns The name of the level-of-detail file stored next to a logfile */
+string lodFileName(const string& logFileName)
+{
+	return replaceExtension(logFileName, ".lod");
+}
+
+/*! \brief Constructor */
+SessionIndexWriter::SessionIndexWriter()
+	: m_samplesPerChunk(0)
+	, m_sampleCount(0)
+	, m_chunk()
+	, m_lodOk(true)
+{
+}
+
+/*! \brief Destructor, completes the index if it is still open and waits for the level-of-detail file */
+SessionIndexWriter::~SessionIndexWriter()
+{
+	close();
+	waitForLod();
+}
+
+/*! \brief Start writing the trajectory and index files of a session
+	\param logFileName The logfile of the session, the files are stored next to it
+	\param bluetoothAddress The address of the device that recorded the session
+	\param samplesPerChunk The number of samples summarized by one index entry
+	\param writerSettings How the trajectory file is written in the background
+	\param resume Continue the trajectory file of an interrupted session instead of starting a new one,
+	its samples are indexed again. A trailing partial sample or block padding is cut off.
+	\returns False if the trajectory file could not be created
+*/
+bool SessionIndexWriter::open(const string& logFileName, const string& bluetoothAddress, uint32_t samplesPerChunk,
+	const AsyncWriterSettings& writerSettings, bool resume)
+{
+	// The builder of the previous session may still read a trajectory file this one truncates
+	close();
+	waitForLod();
+	m_trajectoryFileName = trajectoryFileName(logFileName);
+	m_indexFileName = indexFileName(logFileName);
+	m_lodFileName = lodFileName(logFileName);
+	m_bluetoothAddress = bluetoothAddress;
+	m_samplesPerChunk = max<uint32_t>(samplesPerChunk, 1);
+	m_sampleCount = 0;
+	m_chunk = ChunkSummary();
+	m_chunks.clear();
+
+	int64_t keepSize = -1;
+	if (resume)
+	{
+		keepSize = 0;
+		FILE* file = fopen(m_trajectoryFileName.c_str(), "rb");
+		if (file)
+		{
+			// Zero padding of the last direct I/O block reads as samples at time 0
+			vector<TrajectorySample> samples(4096);
+			size_t count;
+			bool padding = false;
+			while (!padding && (count = fread(samples.data(), sizeof(TrajectorySample), samples.size(), file)) > 0)
+			{
+				for (size_t i = 0; i < count && !padding; ++i)
+				{
+					padding = samples[i].time == 0.0;
+					if (!padding)
+						addToChunk(samples[i]);
+				}
+			}
+			fclose(file);
+			keepSize = static_cast<int64_t>(m_sampleCount * sizeof(TrajectorySample));
+		}
+	}
+
+	if (!m_trajectory.open(m_trajectoryFileName, writerSettings, keepSize))
+	{
+		m_chunks.clear();
+		return false;
+	}
+	return true;
+}
+
+/*! \brief Append an integrated pose to the trajectory
+	\param time The time of the pose in seconds since the epoch
+	\param position The position in the navigation frame
+	\param orientation The attitude
+	\returns False if the sample could not be written
+*/
+bool SessionIndexWriter::append(double time, const Vec3& position, const Quat& orientation)
+{
+	if (!m_trajectory.isOpen())
+		return false;
+
+	TrajectorySample sample = {};
+	sample.time = time;
+	sample.position[0] = static_cast<float>(position.x);
+	sample.position[1] = static_cast<float>(position.y);
+	sample.position[2] = static_cast<float>(position.z);
+	sample.orientation[0] = static_cast<float>(orientation.w);
+	sample.orientation[1] = static_cast<float>(orientation.x);
+	sample.orientation[2] = static_cast<float>(orientation.y);
+	sample.orientation[3] = static_cast<float>(orientation.z);
+	if (!m_trajectory.write(&sample, sizeof(sample)))
+		return false;
+
+	addToChunk(sample);
+	return true;
+}
+
+/*! \brief Hand the samples appended so far to the background writer, without waiting for the disk
+	\details With O_DIRECT the samples of the last partial block stay buffered, see AsyncWriter::flush()
+*/
+void SessionIndexWriter::flush()
+{
+	m_trajectory.flush();
+}
+
+/*! \brief Add a written sample to the summary of the current chunk */
+void SessionIndexWriter::addToChunk(const TrajectorySample& sample)
+{
+	if (m_chunk.sampleCount == 0)
+	{
+		m_chunk.firstSample = m_sampleCount;
+		m_chunk.startTime = sample.time;
+		copy(sample.position, sample.position + 3, m_chunk.min);
+		copy(sample.position, sample.position + 3, m_chunk.max);
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		m_chunk.min[i] = min(m_chunk.min[i], sample.position[i]);
+		m_chunk.max[i] = max(m_chunk.max[i], sample.position[i]);
+	}
+	m_chunk.endTime = sample.time;
+	++m_chunk.sampleCount;
+	++m_sampleCount;
+
+	if (m_chunk.sampleCount == m_samplesPerChunk)
+		finishChunk();
+}
+
+/*! \brief Complete the trajectory file, write the index file and start building the level-of-detail file
+	\returns False if the trajectory or the index could not be written completely
+*/
+bool SessionIndexWriter::close()
+{
+	if (!m_trajectory.isOpen())
+		return true;
+
+	finishChunk();
+	bool ok = m_trajectory.close();
+
+	FILE* index = fopen(m_indexFileName.c_str(), "wb");
+	if (!index)
+		return false;
+
+	IndexHeader header = {};
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.version = INDEX_VERSION;
+	header.samplesPerChunk = m_samplesPerChunk;
+	strncpy(header.bluetoothAddress, m_bluetoothAddress.c_str(), sizeof(header.bluetoothAddress) - 1);
+	header.sampleCount = m_sampleCount;
+	header.chunkCount = m_chunks.size();
+	ok = fwrite(&header, sizeof(header), 1, index) == 1 && ok;
+	if (!m_chunks.empty())
+		ok = fwrite(m_chunks.data(), sizeof(ChunkSummary), m_chunks.size(), index) == m_chunks.size() && ok;
+	ok = fclose(index) == 0 && ok;
+
+	// The closing thread may be the pinned real-time loop, the build and its workers must not run there
+	waitForLod();
+	m_lodBuilder = thread([this, trajectoryFileName = m_trajectoryFileName, lodFileName = m_lodFileName]()
+	{
+		setThreadNormal("level-of-detail");
+		m_lodOk = buildTrajectoryLod(trajectoryFileName, lodFileName);
+		if (!m_lodOk)
+			cout << "Could not build the level-of-detail file " << lodFileName << endl;
+	});
+	return ok;
+}
+
+/*! \brief Wait until the level-of-detail file of the last closed session is built
+	\returns False if it could not be built
+*/
+bool SessionIndexWriter::waitForLod()
+{
+	if (m_lodBuilder.joinable())
+		m_lodBuilder.join();
+	return m_lodOk;
+}
+
+/*! \returns True if a session is being written */
+bool SessionIndexWriter::isOpen() const
+{
+	return m_trajectory.isOpen();
+}
+
+/*! \returns The queue and latency statistics of the background trajectory writer */
+AsyncWriterStats SessionIndexWriter::writerStats() const
+{
+	return m_trajectory.stats();
+}
+
+/*! \brief Store the summary of the current chunk and start a new one */
+void SessionIndexWriter::finishChunk()
+{
+	if (m_chunk.sampleCount == 0)
+		return;
+	m_chunks.push_back(m_chunk);
+	m_chunk = ChunkSummary();
+}
+
+/*! \brief Integrate a delta quantities logfile and write its trajectory and index next to it
+	\details Uses the same error-state filter with zero velocity updates as the live processing
+	\param logFileName The logfile to ingest
+	\param samplesPerChunk The number of samples summarized by one index entry
+	\returns False if the logfile could not be read or the output could not be written
+*/
+bool ingestLogFile(const string& logFileName, uint32_t samplesPerChunk)
+{
+	LogFile log;
+	if (!readLogFile(logFileName, log) || log.ticksPerSecond <= 0.0)
+		return false;
+
+	SessionIndexWriter writer;
+	if (!writer.open(logFileName, log.bluetoothAddress, samplesPerChunk))
+		return false;
+
+	ErrorStateFilter filter;
+	SampleTimeUnwrapper unwrapper;
+	int64_t firstTick = 0;
+	int64_t lastTick = 0;
+	bool ok = true;
+	for (size_t i = 0; i < log.samples.size() && ok; ++i)
+	{
+		const LogSample& sample = log.samples[i];
+		int64_t tick = unwrapper.unwrap(sample.sampleTimeFine);
+		if (i == 0)
+			firstTick = tick;
+		else
+		{
+			double dt = (tick - lastTick) / log.ticksPerSecond;
+			filter.propagate(sample.dq, sample.dv, dt);
+			if (isStationary(sample.dq, sample.dv, dt))
+				filter.update(ZeroVelocityMeasurement());
+		}
+		lastTick = tick;
+
+		const NavigationState& nav = filter.state().navigation;
+		ok = writer.append(log.startTime + (tick - firstTick) / log.ticksPerSecond, nav.position, nav.attitude);
+	}
+	ok = writer.close() && ok;
+	return writer.waitForLod() && ok;
+}
+
+/*! \brief Load the chunk summaries of a session, call build() after adding all sessions
+	\param indexFileName The .idx file of the session, the .traj file is expected next to it
+	\returns False if the index file could not be read
+*/
+bool TrajectoryDatabase::addSession(const string& indexFileName)
+{
+	FILE* file = fopen(indexFileName.c_str(), "rb");
+	if (!file)
+		return false;
+
+	IndexHeader header;
+	Session session;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+		&& header.version == INDEX_VERSION;
+	if (ok)
+	{
+		session.chunks.resize(header.chunkCount);
+		ok = header.chunkCount == 0 || fread(session.chunks.data(), sizeof(ChunkSummary), session.chunks.size(), file) == session.chunks.size();
+	}
+	fclose(file);
+	if (!ok)
+		return false;
+
+	header.bluetoothAddress[sizeof(header.bluetoothAddress) - 1] = '\0';
+	session.bluetoothAddress = header.bluetoothAddress;
+	session.trajectoryFileName = replaceExtension(indexFileName, ".traj");
+
+	uint32_t sessionIndex = static_cast<uint32_t>(m_sessions.size());
+	for (uint32_t c = 0; c < session.chunks.size(); ++c)
+	{
+		const ChunkSummary& chunk = session.chunks[c];
+		Entry entry;
+		entry.session = sessionIndex;
+		entry.chunk = c;
+		entry.box.min[0] = chunk.startTime;
+		entry.box.max[0] = chunk.endTime;
+		for (int i = 0; i < 3; ++i)
+		{
+			entry.box.min[i + 1] = chunk.min[i];
+			entry.box.max[i + 1] = chunk.max[i];
+		}
+		m_entries.push_back(entry);
+	}
+	m_sessions.push_back(move(session));
+	return true;
+}
+
+/*! \brief Bulk load the R-tree over the chunks of all added sessions */
+void TrajectoryDatabase::build()
+{
+	m_levels.clear();
+	if (m_entries.empty())
+		return;
+
+	m_levels.emplace_back();
+	packLevel(m_entries, m_levels.back());
+	while (m_levels.back().size() > 1)
+	{
+		vector<Node> parents;
+		packLevel(m_levels.back(), parents);
+		m_levels.push_back(move(parents));
+	}
+}
+
+/*! \returns The number of sessions in the database */
+size_t TrajectoryDatabase::sessionCount() const
+{
+	return m_sessions.size();
+}
+
+/*! \returns The bluetooth address of the device that recorded a session */
+const string& TrajectoryDatabase::sessionAddress(size_t session) const
+{
+	return m_sessions[session].bluetoothAddress;
+}
+
+/*! \returns The trajectory file of a session */
+const string& TrajectoryDatabase::sessionTrajectory(size_t session) const
+{
+	return m_sessions[session].trajectoryFileName;
+}
+
+/*! \brief Find the parts of all trajectories that are inside the query box during the query time range
+	\param query The query
+	\param matches Receives the matching runs of samples, in index order
+	\param chunksRead Optionally receives the number of chunks that were read from disk
+	\returns The number of matches
+*/
+size_t TrajectoryDatabase::query(const TrajectoryQuery& query, vector<TrajectoryMatch>& matches, size_t* chunksRead) const
+{
+	matches.clear();
+	if (chunksRead)
+		*chunksRead = 0;
+	if (m_levels.empty())
+		return 0;
+
+	Box q;
+	q.min[0] = query.startTime;
+	q.max[0] = query.endTime;
+	for (int i = 0; i < 3; ++i)
+	{
+		q.min[i + 1] = query.min[i];
+		q.max[i + 1] = query.max[i];
+	}
+	auto overlaps = [&q](const Box& b) {
+		for (int i = 0; i < 4; ++i)
+			if (b.max[i] < q.min[i] || b.min[i] > q.max[i])
+				return false;
+		return true;
+	};
+
+	vector<Entry> candidates;
+	vector<pair<size_t, uint32_t>> stack;
+	for (uint32_t i = 0; i < m_levels.back().size(); ++i)
+		stack.emplace_back(m_levels.size() - 1, i);
+	while (!stack.empty())
+	{
+		size_t level = stack.back().first;
+		const Node& node = m_levels[level][stack.back().second];
+		stack.pop_back();
+		if (!overlaps(node.box))
+			continue;
+
+		for (uint32_t c = node.first; c < node.first + node.count; ++c)
+		{
+			if (level > 0)
+				stack.emplace_back(level - 1, c);
+			else if (overlaps(m_entries[c].box)
+				&& (query.bluetoothAddress.empty() || query.bluetoothAddress == m_sessions[m_entries[c].session].bluetoothAddress))
+				candidates.push_back(m_entries[c]);
+		}
+	}
+
+	sort(candidates.begin(), candidates.end(), [](const Entry& a, const Entry& b) {
+		return a.session != b.session ? a.session < b.session : a.chunk < b.chunk;
+	});
+	for (auto const& entry : candidates)
+		refine(entry, query, matches);
+	if (chunksRead)
+		*chunksRead = candidates.size();
+	return matches.size();
+}
+
+/*! \brief Group the items of one tree level into parent nodes of up to NODE_CAPACITY children
+	\details The items are reordered in place, the parents refer to contiguous ranges of them
+*/
+template <class T>
+void TrajectoryDatabase::packLevel(vector<T>& items, vector<Node>& parents)
+{
+	strOrder(items, 0, items.size(), 0, 3);
+
+	parents.clear();
+	for (size_t first = 0; first < items.size(); first += NODE_CAPACITY)
+	{
+		Node node;
+		node.first = static_cast<uint32_t>(first);
+		node.count = static_cast<uint32_t>(min(NODE_CAPACITY, items.size() - first));
+		node.box = items[first].box;
+		for (size_t i = first + 1; i < first + node.count; ++i)
+			for (int d = 0; d < 4; ++d)
+			{
+				node.box.min[d] = min(node.box.min[d], items[i].box.min[d]);
+				node.box.max[d] = max(node.box.max[d], items[i].box.max[d]);
+			}
+		parents.push_back(node);
+	}
+}
+
+/*! \brief Read the samples of a candidate chunk and add the runs that satisfy the query */
+void TrajectoryDatabase::refine(const Entry& entry, const TrajectoryQuery& query, vector<TrajectoryMatch>& matches) const
+{
+	const Session& session = m_sessions[entry.session];
+	const ChunkSummary& chunk = session.chunks[entry.chunk];
+
+	FILE* file = fopen(session.trajectoryFileName.c_str(), "rb");
+	if (!file)
+		return;
+	vector<TrajectorySample> samples(chunk.sampleCount);
+	bool ok = fseeko(file, static_cast<off_t>(chunk.firstSample * sizeof(TrajectorySample)), SEEK_SET) == 0
+		&& fread(samples.data(), sizeof(TrajectorySample), samples.size(), file) == samples.size();
+	fclose(file);
+	if (!ok)
+		return;
+
+	bool inRun = false;
+	for (auto const& s : samples)
+	{
+		bool inside = s.time >= query.startTime && s.time <= query.endTime;
+		for (int i = 0; i < 3 && inside; ++i)
+			inside = s.position[i] >= query.min[i] && s.position[i] <= query.max[i];
+
+		if (inside && !inRun)
+		{
+			// Continue the previous run if it ended at the last sample of the previous chunk
+			bool continues = !matches.empty() && matches.back().session == entry.session && entry.chunk > 0
+				&& &s == &samples.front() && matches.back().endTime == session.chunks[entry.chunk - 1].endTime;
+			if (!continues)
+				matches.push_back({ entry.session, s.time, s.time, 0 });
+		}
+		if (inside)
+		{
+			matches.back().endTime = s.time;
+			++matches.back().sampleCount;
+		}
+		inRun = inside;
+	}
+}
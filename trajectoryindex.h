@@ -0,0 +1,155 @@
+#ifndef TRAJECTORY_INDEX_H
+#define TRAJECTORY_INDEX_H
+
+#include "asyncwriter.h"
+#include "imumath.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*! \brief One integrated pose, the record of a .traj trajectory file */
+struct TrajectorySample
+{
+	double time;			//!< Seconds since the epoch
+	float position[3];		//!< Position in the navigation frame in m
+	float orientation[4];	//!< Attitude quaternion w, x, y, z
+	float reserved;
+};
+
+/*! \brief Summary of a block of consecutive trajectory samples, the record of a .idx index file */
+struct ChunkSummary
+{
+	uint64_t firstSample;
+	uint32_t sampleCount;
+	uint32_t reserved;
+	double startTime;
+	double endTime;
+	float min[3];
+	float max[3];
+};
+
+/*! \brief Time range and bounding box of a query, unset limits are infinite */
+struct TrajectoryQuery
+{
+	std::string bluetoothAddress;	//!< Only match this sensor, any sensor when empty
+	double startTime;
+	double endTime;
+	double min[3];
+	double max[3];
+
+	TrajectoryQuery();
+};
+
+/*! \brief A run of consecutive samples of one session that satisfies a query */
+struct TrajectoryMatch
+{
+	size_t session;
+	double startTime;
+	double endTime;
+	size_t sampleCount;
+};
+
+std::string trajectoryFileName(const std::string& logFileName);
+std::string indexFileName(const std::string& logFileName);
+std::string lodFileName(const std::string& logFileName);
+
+/*! \brief Writes the trajectory of one session and builds its chunk index while samples come in
+	\details The trajectory is written by a background AsyncWriter, so append() never waits for the disk.
+	Its level-of-detail pyramid is built on a background thread with the normal scheduler when the
+	session is closed, so closing never waits for it; waitForLod() does.
+*/
+class SessionIndexWriter
+{
+public:
+	SessionIndexWriter();
+	~SessionIndexWriter();
+
+	bool open(const std::string& logFileName, const std::string& bluetoothAddress, uint32_t samplesPerChunk = 1024,
+		const AsyncWriterSettings& writerSettings = AsyncWriterSettings(), bool resume = false);
+	bool append(double time, const Vec3& position, const Quat& orientation);
+	void flush();
+	bool close();
+	bool waitForLod();
+	bool isOpen() const;
+
+	AsyncWriterStats writerStats() const;
+
+private:
+	SessionIndexWriter(const SessionIndexWriter&) = delete;
+	SessionIndexWriter& operator=(const SessionIndexWriter&) = delete;
+
+	void addToChunk(const TrajectorySample& sample);
+	void finishChunk();
+
+	AsyncWriter m_trajectory;
+	std::string m_trajectoryFileName;
+	std::string m_indexFileName;
+	std::string m_lodFileName;
+	std::string m_bluetoothAddress;
+	uint32_t m_samplesPerChunk;
+	uint64_t m_sampleCount;
+	ChunkSummary m_chunk;
+	std::vector<ChunkSummary> m_chunks;
+	std::thread m_lodBuilder;
+	bool m_lodOk;
+};
+
+bool ingestLogFile(const std::string& logFileName, uint32_t samplesPerChunk = 1024);
+
+/*! \brief Chunk summaries of a set of sessions with a packed R-tree over them
+	\details Each leaf entry is the time range and bounding box of one chunk. The tree is bulk loaded
+	with Sort-Tile-Recursive packing over time and the horizontal position, so a query only visits
+	the nodes that overlap it and only reads the matching chunks from the trajectory files.
+*/
+class TrajectoryDatabase
+{
+public:
+	bool addSession(const std::string& indexFileName);
+	void build();
+
+	size_t sessionCount() const;
+	const std::string& sessionAddress(size_t session) const;
+	const std::string& sessionTrajectory(size_t session) const;
+	size_t query(const TrajectoryQuery& query, std::vector<TrajectoryMatch>& matches, size_t* chunksRead = nullptr) const;
+
+private:
+	struct Box
+	{
+		double min[4];
+		double max[4];
+	};
+
+	struct Node
+	{
+		Box box;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	struct Entry
+	{
+		Box box;
+		uint32_t session;
+		uint32_t chunk;
+	};
+
+	struct Session
+	{
+		std::string bluetoothAddress;
+		std::string trajectoryFileName;
+		std::vector<ChunkSummary> chunks;
+	};
+
+	template <class T>
+	static void packLevel(std::vector<T>& items, std::vector<Node>& parents);
+	void refine(const Entry& entry, const TrajectoryQuery& query, std::vector<TrajectoryMatch>& matches) const;
+
+	std::vector<Session> m_sessions;
+	std::vector<Entry> m_entries;
+	std::vector<std::vector<Node>> m_levels;
+};
+
+#endif
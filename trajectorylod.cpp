@@ -0,0 +1,306 @@
+#include "trajectorylod.h"
+
+#include "parallelfor.h"
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+const char LOD_MAGIC[8] = { 'I', 'M', 'U', 'L', 'O', 'D', '1', '\0' };
+const uint32_t LOD_VERSION = 1;
+
+struct LodHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t levelCount;
+	uint64_t sourceSampleCount;
+};
+
+Vec3 samplePosition(const TrajectorySample& sample)
+{
+	return { sample.position[0], sample.position[1], sample.position[2] };
+}
+
+Quat sampleOrientation(const TrajectorySample& sample)
+{
+	return { sample.orientation[0], sample.orientation[1], sample.orientation[2], sample.orientation[3] };
+}
+
+/*! \returns The error of \a sample relative to the straight segment from \a first to \a last, in units of the tolerances
+	\details The position error is the distance to the segment, the attitude error is the angle to
+	the attitude interpolated at the time of the sample. The larger of the two counts.
+*/
+double segmentError(const TrajectorySample& first, const TrajectorySample& last, const TrajectorySample& sample,
+	double positionTolerance, double orientationTolerance)
+{
+	Vec3 a = samplePosition(first);
+	Vec3 ab = samplePosition(last) - a;
+	Vec3 ap = samplePosition(sample) - a;
+	double length = dot(ab, ab);
+	double along = length > 0.0 ? min(max(dot(ap, ab) / length, 0.0), 1.0) : 0.0;
+	double positionError = norm(ap - ab * along);
+
+	double duration = last.time - first.time;
+	double fraction = duration > 0.0 ? (sample.time - first.time) / duration : 0.0;
+	Quat from = sampleOrientation(first);
+	Quat to = sampleOrientation(last);
+	Quat interpolated;
+	slerpBatch(&from, &to, &fraction, &interpolated, 1);
+	Quat actual = quatNormalized(sampleOrientation(sample));
+	double c = fabs(interpolated.w * actual.w + interpolated.x * actual.x + interpolated.y * actual.y + interpolated.z * actual.z);
+	double orientationError = 2.0 * acos(min(c, 1.0));
+
+	return max(positionError / positionTolerance, orientationError / orientationTolerance);
+}
+
+/*! \brief Douglas-Peucker simplification of a run of samples
+	\param samples All samples of the trajectory
+	\param input The indices of the run, in time order
+	\param output Receives the kept indices, always including the first and the last
+*/
+void simplify(const vector<TrajectorySample>& samples, const vector<uint32_t>& input, vector<uint32_t>& output,
+	double positionTolerance, double orientationTolerance)
+{
+	output.clear();
+	if (input.size() <= 2)
+	{
+		output = input;
+		return;
+	}
+
+	vector<uint8_t> keep(input.size(), 0);
+	keep.front() = 1;
+	keep.back() = 1;
+
+	// Explicit stack of segments, a long straight run would recurse very deep
+	vector<pair<size_t, size_t>> segments;
+	segments.push_back({ 0, input.size() - 1 });
+	while (!segments.empty())
+	{
+		size_t first = segments.back().first;
+		size_t last = segments.back().second;
+		segments.pop_back();
+
+		double worst = 1.0;
+		size_t split = 0;
+		for (size_t i = first + 1; i < last; ++i)
+		{
+			double error = segmentError(samples[input[first]], samples[input[last]], samples[input[i]], positionTolerance, orientationTolerance);
+			if (error > worst)
+			{
+				worst = error;
+				split = i;
+			}
+		}
+		if (split)
+		{
+			keep[split] = 1;
+			segments.push_back({ first, split });
+			segments.push_back({ split, last });
+		}
+	}
+
+	for (size_t i = 0; i < input.size(); ++i)
+		if (keep[i])
+			output.push_back(input[i]);
+}
+}
+
+/*! \brief Build the level-of-detail pyramid of a trajectory file
+	\details The trajectory is cut into chunks that are simplified in parallel. Neighbouring chunks
+	share their boundary sample, which every level keeps, so the levels are continuous.
+	\param trajectoryFileName The .traj file
+	\param lodFileName The .lod file to write, it is overwritten
+	\param settings The tolerances and the number of levels
+	\returns False if the trajectory could not be read or the pyramid could not be written
+*/
+bool buildTrajectoryLod(const string& trajectoryFileName, const string& lodFileName, const LodSettings& settings)
+{
+	FILE* file = fopen(trajectoryFileName.c_str(), "rb");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	vector<TrajectorySample> samples(size > 0 ? static_cast<size_t>(size) / sizeof(TrajectorySample) : 0);
+	bool ok = samples.empty() || fread(samples.data(), sizeof(TrajectorySample), samples.size(), file) == samples.size();
+	fclose(file);
+	if (!ok)
+		return false;
+
+	// Every chunk runs through all levels on its own, each level simplifies the level below it
+	size_t chunkLength = max<uint32_t>(settings.samplesPerChunk, 2);
+	size_t chunkCount = samples.size() > 1 ? (samples.size() - 2) / (chunkLength - 1) + 1 : samples.size();
+	size_t maxLevels = max<uint32_t>(settings.maxLevels, 1);
+	vector<vector<vector<uint32_t>>> chunkLevels(chunkCount, vector<vector<uint32_t>>(maxLevels));
+	parallelFor(chunkCount, [&](size_t c)
+	{
+		size_t first = c * (chunkLength - 1);
+		size_t last = min(first + chunkLength - 1, samples.size() - 1);
+		vector<uint32_t> input;
+		for (size_t i = first; i <= last; ++i)
+			input.push_back(static_cast<uint32_t>(i));
+
+		double scale = 1.0;
+		for (size_t l = 0; l < maxLevels; ++l, scale *= 2.0)
+		{
+			simplify(samples, l ? chunkLevels[c][l - 1] : input, chunkLevels[c][l],
+				settings.positionTolerance * scale, settings.orientationTolerance * scale);
+		}
+	});
+
+	// Join the chunks of each level, dropping the boundary sample each chunk shares with the previous one.
+	// An empty trajectory has no levels.
+	vector<LodLevel> levels;
+	vector<TrajectorySample> output;
+	double scale = 1.0;
+	for (size_t l = 0; chunkCount && l < maxLevels; ++l, scale *= 2.0)
+	{
+		LodLevel level = { settings.positionTolerance * scale, settings.orientationTolerance * scale, output.size(), 0 };
+		for (size_t c = 0; c < chunkCount; ++c)
+			for (size_t i = c ? 1 : 0; i < chunkLevels[c][l].size(); ++i)
+				output.push_back(samples[chunkLevels[c][l][i]]);
+		level.sampleCount = output.size() - level.firstSample;
+
+		// Coarser levels that no longer shrink are not worth storing
+		if (!levels.empty() && level.sampleCount == levels.back().sampleCount)
+		{
+			output.resize(level.firstSample);
+			break;
+		}
+		levels.push_back(level);
+	}
+
+	file = fopen(lodFileName.c_str(), "wb");
+	if (!file)
+		return false;
+
+	LodHeader header = {};
+	memcpy(header.magic, LOD_MAGIC, sizeof(LOD_MAGIC));
+	header.version = LOD_VERSION;
+	header.levelCount = static_cast<uint32_t>(levels.size());
+	header.sourceSampleCount = samples.size();
+	ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (!levels.empty())
+		ok = fwrite(levels.data(), sizeof(LodLevel), levels.size(), file) == levels.size() && ok;
+	if (!output.empty())
+		ok = fwrite(output.data(), sizeof(TrajectorySample), output.size(), file) == output.size() && ok;
+	return fclose(file) == 0 && ok;
+}
+
+/*! \brief Load a level-of-detail pyramid
+	\param lodFileName The .lod file
+	\returns False if the file could not be read
+*/
+bool TrajectoryLod::open(const string& lodFileName)
+{
+	m_levels.clear();
+	m_samples.clear();
+	m_sourceSampleCount = 0;
+
+	FILE* file = fopen(lodFileName.c_str(), "rb");
+	if (!file)
+		return false;
+
+	LodHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, LOD_MAGIC, sizeof(LOD_MAGIC)) == 0
+		&& header.version == LOD_VERSION;
+	if (ok)
+	{
+		m_levels.resize(header.levelCount);
+		ok = m_levels.empty() || fread(m_levels.data(), sizeof(LodLevel), m_levels.size(), file) == m_levels.size();
+	}
+	if (ok && !m_levels.empty())
+	{
+		m_samples.resize(m_levels.back().firstSample + m_levels.back().sampleCount);
+		ok = m_samples.empty() || fread(m_samples.data(), sizeof(TrajectorySample), m_samples.size(), file) == m_samples.size();
+	}
+	fclose(file);
+
+	if (!ok)
+	{
+		m_levels.clear();
+		m_samples.clear();
+		return false;
+	}
+	m_sourceSampleCount = header.sourceSampleCount;
+	return true;
+}
+
+/*! \returns The number of levels, 0 for an empty trajectory */
+size_t TrajectoryLod::levelCount() const
+{
+	return m_levels.size();
+}
+
+/*! \returns The tolerances and size of a level, 0 is the finest */
+const LodLevel& TrajectoryLod::level(size_t index) const
+{
+	return m_levels[index];
+}
+
+/*! \returns The number of samples of the original trajectory */
+uint64_t TrajectoryLod::sourceSampleCount() const
+{
+	return m_sourceSampleCount;
+}
+
+/*! \brief Get the samples of a time range from the finest level that fits a point budget
+	\details The last sample before the range and the first one after it are included, so a plot of
+	the range reaches its edges even when a coarse level has no sample close to them. When even the
+	coarsest level has too many samples, every n-th of them is returned, always ending with the last.
+	\param startTime The start of the range in seconds since the epoch
+	\param endTime The end of the range
+	\param budget The largest number of samples to return
+	\param samples Receives the samples, in time order
+	\returns The level the samples were taken from, -1 if the range does not overlap the trajectory
+*/
+int TrajectoryLod::query(double startTime, double endTime, size_t budget, vector<TrajectorySample>& samples) const
+{
+	samples.clear();
+	if (m_levels.empty() || budget == 0)
+		return -1;
+
+	auto before = [](const TrajectorySample& sample, double time) { return sample.time < time; };
+	auto after = [](double time, const TrajectorySample& sample) { return time < sample.time; };
+
+	size_t l = 0;
+	const TrajectorySample* first = nullptr;
+	const TrajectorySample* last = nullptr;
+	for (; l < m_levels.size(); ++l)
+	{
+		const TrajectorySample* begin = m_samples.data() + m_levels[l].firstSample;
+		const TrajectorySample* end = begin + m_levels[l].sampleCount;
+		first = lower_bound(begin, end, startTime, before);
+		last = upper_bound(first, end, endTime, after);
+		bool overlaps = begin != end && begin->time <= endTime && (end - 1)->time >= startTime;
+		if (overlaps && first != begin)
+			--first;
+		if (overlaps && last != end)
+			++last;
+		if (static_cast<size_t>(last - first) <= budget)
+			break;
+	}
+	if (l == m_levels.size())
+		--l;
+
+	size_t count = static_cast<size_t>(last - first);
+	if (count == 0)
+		return -1;
+
+	size_t stride = (count + budget - 1) / budget;
+	for (size_t i = 0; i < count; i += stride)
+		samples.push_back(first[i]);
+	if ((count - 1) % stride)
+		samples.back() = first[count - 1];
+	return static_cast<int>(l);
+}
@@ -0,0 +1,53 @@
+#ifndef TRAJECTORY_LOD_H
+#define TRAJECTORY_LOD_H
+
+#include "trajectoryindex.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*! \brief How the level-of-detail pyramid of a trajectory is built */
+struct LodSettings
+{
+	double positionTolerance = 0.01;		//!< Largest position error of the finest level in m
+	double orientationTolerance = 0.01;		//!< Largest attitude error of the finest level in rad
+	uint32_t samplesPerChunk = 4096;		//!< Chunks are simplified independently and in parallel
+	uint32_t maxLevels = 12;				//!< The tolerances double from one level to the next
+};
+
+/*! \brief One level of a pyramid, the record following the header of a .lod file */
+struct LodLevel
+{
+	double positionTolerance;
+	double orientationTolerance;
+	uint64_t firstSample;		//!< Index of the first sample of the level in the sample block of the file
+	uint64_t sampleCount;
+};
+
+bool buildTrajectoryLod(const std::string& trajectoryFileName, const std::string& lodFileName, const LodSettings& settings = LodSettings());
+
+/*! \brief Level-of-detail pyramid of a trajectory, for plotting long sessions
+	\details Each level is the trajectory simplified with Douglas-Peucker on position and attitude,
+	with twice the tolerances of the level below it. Every level is built from the one below it, so
+	level l is within twice its tolerances of the original trajectory. The whole pyramid is kept in
+	memory, a query only searches the time range in each level.
+*/
+class TrajectoryLod
+{
+public:
+	bool open(const std::string& lodFileName);
+
+	size_t levelCount() const;
+	const LodLevel& level(size_t index) const;
+	uint64_t sourceSampleCount() const;
+
+	int query(double startTime, double endTime, size_t budget, std::vector<TrajectorySample>& samples) const;
+
+private:
+	uint64_t m_sourceSampleCount = 0;
+	std::vector<LodLevel> m_levels;
+	std::vector<TrajectorySample> m_samples;
+};
+
+#endif
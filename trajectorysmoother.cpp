@@ -0,0 +1,197 @@
+#include "trajectorysmoother.h"
+
+using namespace std;
+
+/*! \brief Constructor
+	\param lag The number of samples a pose is refined over before it is emitted
+	\param settings The noise settings of the forward filter
+*/
+TrajectorySmoother::TrajectorySmoother(size_t lag, const SmootherSettings& settings)
+	: m_settings(settings)
+	, m_ring(lag + 1)
+{
+	reset();
+}
+
+/*! \brief Discard the window and restart the forward filter from \a state */
+void TrajectorySmoother::reset(const NavigationState& state)
+{
+	m_integrator.reset(state);
+	m_x = StateVector();
+	m_x(0, 0) = state.position.x;
+	m_x(1, 0) = state.position.y;
+	m_x(2, 0) = state.position.z;
+	m_x(3, 0) = state.velocity.x;
+	m_x(4, 0) = state.velocity.y;
+	m_x(5, 0) = state.velocity.z;
+
+	m_p = StateMatrix();
+	double pp = m_settings.initialPositionStd * m_settings.initialPositionStd;
+	double vv = m_settings.initialVelocityStd * m_settings.initialVelocityStd;
+	for (int i = 0; i < 3; ++i)
+	{
+		m_p(i, i) = pp;
+		m_p(i + 3, i + 3) = vv;
+	}
+
+	m_head = 0;
+	m_count = 0;
+}
+
+/*! \brief Add a delta quantities sample
+	\param time The time of the sample in seconds
+	\param dq The orientation increment of the sample
+	\param dv The velocity increment of the sample, in the sensor frame
+	\param dt The sample interval in seconds
+	\param pose Receives the smoothed pose that left the window, if any
+	\returns True if \a pose was filled, which happens once the window holds more than lag samples
+*/
+bool TrajectorySmoother::addSample(double time, const Quat& dq, const Vec3& dv, double dt, SmoothedPose& pose)
+{
+	m_integrator.propagate(dq, dv, dt);
+	Vec3 a = m_integrator.acceleration();
+
+	// Predict with a constant acceleration over the interval
+	StateMatrix f = StateMatrix::identity();
+	for (int i = 0; i < 3; ++i)
+		f(i, i + 3) = dt;
+
+	StateVector x = f * m_x;
+	x(0, 0) += 0.5 * dt * dt * a.x;
+	x(1, 0) += 0.5 * dt * dt * a.y;
+	x(2, 0) += 0.5 * dt * dt * a.z;
+	x(3, 0) += dt * a.x;
+	x(4, 0) += dt * a.y;
+	x(5, 0) += dt * a.z;
+
+	double q = m_settings.accelerationNoise * m_settings.accelerationNoise;
+	StateMatrix p = f * m_p * f.transposed();
+	for (int i = 0; i < 3; ++i)
+	{
+		p(i, i) += q * dt * dt * dt / 3.0;
+		p(i, i + 3) += q * dt * dt / 2.0;
+		p(i + 3, i) += q * dt * dt / 2.0;
+		p(i + 3, i + 3) += q * dt;
+	}
+
+	StateVector predicted = x;
+	StateMatrix predictedCovariance = p;
+
+	// Zero velocity update, H selects the velocity block so the gain is the velocity column block of P
+	if (isStationary(dq, dv, dt))
+	{
+		Matrix<3, 3> s = p.block<3, 3>(3, 3);
+		double r = m_settings.zeroVelocityNoise * m_settings.zeroVelocityNoise;
+		for (int i = 0; i < 3; ++i)
+			s(i, i) += r;
+
+		Matrix<3, 3> sInv;
+		if (invert(s, sInv))
+		{
+			Matrix<6, 3> k = p.block<6, 3>(0, 3) * sInv;
+			Matrix<3, 1> innovation = (x.block<3, 1>(3, 0)) * -1.0;
+			x += k * innovation;
+			p -= k * p.block<3, 6>(3, 0);
+			symmetrize(p);
+		}
+	}
+
+	m_x = x;
+	m_p = p;
+
+	// Store the step and complete the smoother gain of its predecessor
+	if (m_count == m_ring.size())
+	{
+		m_head = (m_head + 1) % m_ring.size();
+		--m_count;
+	}
+	Step& current = step(m_count++);
+	current.time = time;
+	current.attitude = m_integrator.state().attitude;
+	current.filtered = x;
+	current.filteredCovariance = p;
+	current.predicted = predicted;
+	current.predictedCovariance = predictedCovariance;
+
+	if (m_count >= 2)
+	{
+		Step& previous = step(m_count - 2);
+		StateMatrix predictedInverse;
+		if (invert(predictedCovariance, predictedInverse))
+			previous.gain = previous.filteredCovariance * f.transposed() * predictedInverse;
+		else
+			previous.gain = StateMatrix();
+	}
+
+	if (m_count < m_ring.size())
+		return false;
+
+	smoothWindow();
+	pose = poseOf(step(0));
+	return true;
+}
+
+/*! \brief Emit the poses still in the window, smoothed with the data available so far
+	\param poses The smoothed poses are appended to this list, oldest first
+	\returns The number of poses appended
+*/
+size_t TrajectorySmoother::flush(vector<SmoothedPose>& poses)
+{
+	size_t first = m_count == m_ring.size() ? 1 : 0;
+	if (m_count > first)
+	{
+		smoothWindow();
+		for (size_t i = first; i < m_count; ++i)
+			poses.push_back(poseOf(step(i)));
+	}
+	size_t emitted = m_count - first;
+	m_head = 0;
+	m_count = 0;
+	return emitted;
+}
+
+/*! \returns The number of samples a pose is delayed by the smoother */
+size_t TrajectorySmoother::lag() const
+{
+	return m_ring.size() - 1;
+}
+
+/*! \returns The forward filter estimate of the most recent sample, without smoothing delay */
+NavigationState TrajectorySmoother::filteredState() const
+{
+	NavigationState state;
+	state.attitude = m_integrator.state().attitude;
+	state.position = { m_x(0, 0), m_x(1, 0), m_x(2, 0) };
+	state.velocity = { m_x(3, 0), m_x(4, 0), m_x(5, 0) };
+	return state;
+}
+
+/*! \returns The step at position \a index in the window, 0 being the oldest */
+TrajectorySmoother::Step& TrajectorySmoother::step(size_t index)
+{
+	return m_ring[(m_head + index) % m_ring.size()];
+}
+
+/*! \brief Rauch-Tung-Striebel backward pass over the window, from the newest sample to the oldest */
+void TrajectorySmoother::smoothWindow()
+{
+	Step* next = &step(m_count - 1);
+	next->smoothed = next->filtered;
+	for (size_t i = m_count - 1; i-- > 0;)
+	{
+		Step& current = step(i);
+		current.smoothed = current.filtered + current.gain * (next->smoothed - next->predicted);
+		next = &current;
+	}
+}
+
+/*! \returns The smoothed pose of \a s */
+SmoothedPose TrajectorySmoother::poseOf(const Step& s) const
+{
+	SmoothedPose pose;
+	pose.time = s.time;
+	pose.attitude = s.attitude;
+	pose.position = { s.smoothed(0, 0), s.smoothed(1, 0), s.smoothed(2, 0) };
+	pose.velocity = { s.smoothed(3, 0), s.smoothed(4, 0), s.smoothed(5, 0) };
+	return pose;
+}
@@ -0,0 +1,75 @@
+#ifndef TRAJECTORY_SMOOTHER_H
+#define TRAJECTORY_SMOOTHER_H
+
+#include "fixedmatrix.h"
+#include "strapdown.h"
+
+#include <cstddef>
+#include <vector>
+
+struct SmootherSettings
+{
+	double accelerationNoise = 0.5;		//!< Standard deviation of the acceleration error in m/s^2
+	double zeroVelocityNoise = 0.02;	//!< Standard deviation of a zero velocity observation in m/s
+	double initialVelocityStd = 0.01;	//!< Standard deviation of the initial velocity in m/s
+	double initialPositionStd = 0.01;	//!< Standard deviation of the initial position in m
+};
+
+/*! \brief A pose that has left the smoothing window */
+struct SmoothedPose
+{
+	double time = 0.0;
+	Quat attitude;
+	Vec3 velocity;
+	Vec3 position;
+};
+
+/*! \brief Online fixed-lag smoother of the position and velocity of one device
+	\details A forward Kalman filter integrates the navigation frame acceleration of the strapdown
+	integrator and applies zero velocity updates whenever the device is at rest. The filter results
+	of the last \a lag samples are kept in a preallocated ring buffer together with their
+	Rauch-Tung-Striebel gains, so each new sample costs one backward pass of matrix-vector products
+	over the window and emits the pose that leaves it.
+*/
+class TrajectorySmoother
+{
+public:
+	explicit TrajectorySmoother(size_t lag, const SmootherSettings& settings = SmootherSettings());
+
+	void reset(const NavigationState& state = NavigationState());
+	bool addSample(double time, const Quat& dq, const Vec3& dv, double dt, SmoothedPose& pose);
+	size_t flush(std::vector<SmoothedPose>& poses);
+
+	size_t lag() const;
+	NavigationState filteredState() const;
+
+private:
+	typedef Matrix<6, 1> StateVector;
+	typedef Matrix<6, 6> StateMatrix;
+
+	struct Step
+	{
+		double time = 0.0;
+		Quat attitude;
+		StateVector filtered;
+		StateMatrix filteredCovariance;
+		StateVector predicted;
+		StateMatrix predictedCovariance;
+		StateMatrix gain;
+		StateVector smoothed;
+	};
+
+	Step& step(size_t index);
+	void smoothWindow();
+	SmoothedPose poseOf(const Step& s) const;
+
+	SmootherSettings m_settings;
+	StrapdownIntegrator m_integrator;
+	StateVector m_x;
+	StateMatrix m_p;
+	std::vector<Step> m_ring;
+	size_t m_head = 0;
+	size_t m_count = 0;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include "trajectoryindex.h"
+#include "trajectorylod.h"
+
+using namespace std;
+
+void printUsage()
+{
+	cout << "Usage:" << endl;
+	cout << "  trajquery ingest <logfile.csv> ..." << endl;
+	cout << "      Integrates each logfile and writes its .traj trajectory and .idx index next to it" << endl;
+	cout << "  trajquery query [--sensor <address>] [--time <t0> <t1>] [--box <xmin> <ymin> <zmin> <xmax> <ymax> <zmax>] <.idx file or directory> ..." << endl;
+	cout << "      Lists the parts of the indexed sessions inside the box during [t0, t1], times in seconds since the epoch" << endl;
+	cout << "  trajquery lod <.traj file> ..." << endl;
+	cout << "      Builds the .lod level-of-detail pyramid of each trajectory next to it" << endl;
+	cout << "  trajquery view [--time <t0> <t1>] [--budget <points>] [--output <file.csv>] <.lod file>" << endl;
+	cout << "      Gets at most the budget of points (default 10000) of [t0, t1] from the finest level that fits" << endl;
+}
+
+bool hasSuffix(const string& text, const string& suffix)
+{
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int64_t milliseconds()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds an index file, or every index file in a directory
+size_t addSessions(TrajectoryDatabase& database, const string& path)
+{
+	DIR* dir = opendir(path.c_str());
+	if (!dir)
+	{
+		if (database.addSession(path))
+			return 1;
+		cout << "Could not read index " << path << endl;
+		return 0;
+	}
+
+	size_t added = 0;
+	while (dirent* entry = readdir(dir))
+	{
+		string name = entry->d_name;
+		if (hasSuffix(name, ".idx") && database.addSession(path + "/" + name))
+			++added;
+	}
+	closedir(dir);
+	return added;
+}
+
+int ingest(int argc, char* argv[])
+{
+	int failures = 0;
+	for (int i = 2; i < argc; ++i)
+	{
+		cout << "Ingesting " << argv[i] << "... " << flush;
+		if (ingestLogFile(argv[i]))
+			cout << "OK" << endl;
+		else
+		{
+			cout << "failed" << endl;
+			++failures;
+		}
+	}
+	return failures ? -1 : 0;
+}
+
+int query(int argc, char* argv[])
+{
+	TrajectoryQuery query;
+	TrajectoryDatabase database;
+	for (int i = 2; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--sensor" && i + 1 < argc)
+			query.bluetoothAddress = argv[++i];
+		else if (arg == "--time" && i + 2 < argc)
+		{
+			query.startTime = atof(argv[++i]);
+			query.endTime = atof(argv[++i]);
+		}
+		else if (arg == "--box" && i + 6 < argc)
+		{
+			for (int k = 0; k < 3; ++k)
+				query.min[k] = atof(argv[++i]);
+			for (int k = 0; k < 3; ++k)
+				query.max[k] = atof(argv[++i]);
+		}
+		else
+			addSessions(database, arg);
+	}
+
+	int64_t start = milliseconds();
+	database.build();
+	int64_t built = milliseconds();
+
+	vector<TrajectoryMatch> matches;
+	size_t chunksRead = 0;
+	database.query(query, matches, &chunksRead);
+	int64_t done = milliseconds();
+
+	for (auto const& match : matches)
+		cout << database.sessionAddress(match.session) << "  " << database.sessionTrajectory(match.session)
+			<< fixed << setprecision(3) << "  " << match.startTime << " - " << match.endTime
+			<< "  (" << match.sampleCount << " samples)" << endl;
+
+	cout << matches.size() << " match(es) in " << database.sessionCount() << " session(s), "
+		<< chunksRead << " chunk(s) read, index built in " << built - start << " ms, query took " << done - built << " ms" << endl;
+	return 0;
+}
+
+int lod(int argc, char* argv[])
+{
+	int failures = 0;
+	for (int i = 2; i < argc; ++i)
+	{
+		string fileName = argv[i];
+		cout << "Building the pyramid of " << fileName << "... " << flush;
+		int64_t start = milliseconds();
+		if (buildTrajectoryLod(fileName, lodFileName(fileName)))
+			cout << "OK in " << milliseconds() - start << " ms" << endl;
+		else
+		{
+			cout << "failed" << endl;
+			++failures;
+		}
+	}
+	return failures ? -1 : 0;
+}
+
+int view(int argc, char* argv[])
+{
+	double startTime = -numeric_limits<double>::infinity();
+	double endTime = numeric_limits<double>::infinity();
+	size_t budget = 10000;
+	string outputFileName;
+	string fileName;
+	for (int i = 2; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--time" && i + 2 < argc)
+		{
+			startTime = atof(argv[++i]);
+			endTime = atof(argv[++i]);
+		}
+		else if (arg == "--budget" && i + 1 < argc)
+			budget = strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--output" && i + 1 < argc)
+			outputFileName = argv[++i];
+		else
+			fileName = arg;
+	}
+
+	TrajectoryLod pyramid;
+	int64_t start = milliseconds();
+	if (!pyramid.open(fileName))
+	{
+		cout << "Could not read pyramid " << fileName << endl;
+		return -1;
+	}
+	int64_t loaded = milliseconds();
+
+	vector<TrajectorySample> samples;
+	int level = pyramid.query(startTime, endTime, budget, samples);
+	int64_t done = milliseconds();
+
+	for (size_t l = 0; l < pyramid.levelCount(); ++l)
+		cout << "Level " << l << ": " << pyramid.level(l).sampleCount << " samples, tolerance "
+			<< pyramid.level(l).positionTolerance << " m / " << pyramid.level(l).orientationTolerance << " rad" << endl;
+
+	if (!outputFileName.empty())
+	{
+		ofstream output(outputFileName);
+		output << "Time,PosX,PosY,PosZ,Quat_W,Quat_X,Quat_Y,Quat_Z\n" << fixed << setprecision(6);
+		for (auto const& sample : samples)
+			output << sample.time << "," << sample.position[0] << "," << sample.position[1] << "," << sample.position[2]
+				<< "," << sample.orientation[0] << "," << sample.orientation[1] << "," << sample.orientation[2] << "," << sample.orientation[3] << "\n";
+	}
+
+	cout << samples.size() << " of " << pyramid.sourceSampleCount() << " samples from level " << level
+		<< ", pyramid loaded in " << loaded - start << " ms, query took " << done - loaded << " ms" << endl;
+	return 0;
+}
+
+//--------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	string command = argc > 1 ? argv[1] : "";
+	if (command == "ingest" && argc > 2)
+		return ingest(argc, argv);
+	if (command == "query" && argc > 2)
+		return query(argc, argv);
+	if (command == "lod" && argc > 2)
+		return lod(argc, argv);
+	if (command == "view" && argc > 2)
+		return view(argc, argv);
+
+	printUsage();
+	return -1;
+}
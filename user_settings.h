@@ -31,11 +31,32 @@
 #define USER_SETTINGS_H
 
 #include <xstypes/xsstringarray.h>
+#include "asyncwriter.h"
 
 struct UserSettings
 {
 	XsStringArray m_whiteList = XsStringArray();
 	XsString m_baseDotName = "Movella DOT";
+	double m_sampleTimeFineTicksPerSecond = 1e4;	// Rate of the SampleTimeFine counter, recorded logfiles advance 333 ticks per sample at 30 Hz
+	XsString m_traceFileName = "trace.json";
+	XsString m_checkpointFileName = "integrator.ckpt";
+	XsString m_noiseParameterFileName = "noise_parameters.csv";
+	size_t m_smootherLag = 60;		// Samples the smoothed trajectory lags behind, 0 disables it
+	XsString m_rigFileName = "rig.csv";		// Mounts of rigidly mounted devices, integrated as one virtual IMU
+	double m_rigRateHz = 60.0;
+	int64_t m_checkpointIntervalMs = 200;
+	size_t m_checkpointMaxDevices = 32;
+	bool m_trajectoryDirectIo = false;
+	SyncPolicy m_trajectorySyncPolicy = SyncPolicy::OnClose;
+
+	// Real-time mode, also enabled with the --realtime argument. Core lists are like taskset: "1" or "2-3"
+	bool m_realtime = false;
+	XsString m_realtimeConsumerCpus = "1";	// The packet loop
+	int m_realtimeConsumerPriority = 80;	// SCHED_FIFO priority, 0 keeps the normal scheduler
+	XsString m_realtimeWorkerCpus = "2";	// Background writers
+	int m_realtimeWorkerPriority = 70;
+	int64_t m_realtimePeriodUs = 1000;		// Cycle of the packet loop
+	size_t m_realtimePrefaultBytes = 64 << 20;
 };
 
 #endif
@@ -0,0 +1,278 @@
+#include "virtualimu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+/*! \returns The median of \a values, which are reordered
+	\param values The values
+	\param count The number of values, at least 1
+*/
+double median(double* values, size_t count)
+{
+	size_t middle = count / 2;
+	nth_element(values, values + middle, values + count);
+	double upper = values[middle];
+	if (count % 2)
+		return upper;
+	return 0.5 * (upper + *max_element(values, values + middle));
+}
+
+/*! \returns The sum of inverse variances \a combinedInverseSquare with one more device of noise density \a noise added */
+double combineNoise(double combinedInverseSquare, double noise)
+{
+	return combinedInverseSquare + 1.0 / max(noise * noise, 1e-30);
+}
+}
+
+/*! \brief Read the mounts of the devices of a rig
+	\details Rows that cannot be parsed are skipped, the rotations are normalized.
+	\param fileName The rig file
+	\param mounts Receives the mounts in the order of the file
+	\returns False if the file could not be opened
+*/
+bool loadSensorMounts(const string& fileName, vector<SensorMount>& mounts)
+{
+	ifstream file(fileName);
+	if (!file)
+		return false;
+
+	mounts.clear();
+	string line;
+	while (getline(file, line))
+	{
+		if (line.empty() || line.compare(0, 16, "BluetoothAddress") == 0)
+			continue;
+
+		stringstream fields(line);
+		SensorMount mount;
+		char comma[7];
+		if (getline(fields, mount.bluetoothAddress, ',')
+			&& fields >> mount.rotation.w >> comma[0] >> mount.rotation.x >> comma[1] >> mount.rotation.y >> comma[2] >> mount.rotation.z
+				>> comma[3] >> mount.leverArm.x >> comma[4] >> mount.leverArm.y >> comma[5] >> mount.leverArm.z)
+		{
+			mount.rotation = quatNormalized(mount.rotation);
+			mounts.push_back(mount);
+		}
+	}
+	return true;
+}
+
+/*! \brief Rotate a batch of vectors, each by its own rotation matrix
+	\details The vectors are passed as separate component arrays, so the loop vectorizes
+	\param rotation The row-major rotation matrices, 9 values per vector
+	\param x, y, z The components of the vectors
+	\param outX, outY, outZ Receive the rotated vectors, must not overlap the input
+	\param count The number of vectors
+*/
+void rotateBatch(const double* rotation, const double* x, const double* y, const double* z,
+	double* outX, double* outY, double* outZ, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		const double* r = rotation + 9 * i;
+		outX[i] = r[0] * x[i] + r[1] * y[i] + r[2] * z[i];
+		outY[i] = r[3] * x[i] + r[4] * y[i] + r[5] * z[i];
+		outZ[i] = r[6] * x[i] + r[7] * y[i] + r[8] * z[i];
+	}
+}
+
+/*! \brief Constructor
+	\param mounts The mounts of the devices, device i of the resampled frames is mount i
+	\param noise The noise of each device, for example from the noise parameter file
+	\param settings The outlier rejection settings
+*/
+VirtualImu::VirtualImu(const vector<SensorMount>& mounts, const vector<FilterNoise>& noise, const VirtualImuSettings& settings)
+	: m_noise(noise)
+	, m_settings(settings)
+{
+	size_t count = mounts.size();
+	m_noise.resize(count);
+	for (auto* array : { &m_leverX, &m_leverY, &m_leverZ, &m_gyroWeight, &m_accelerationWeight,
+		&m_frameLeverX, &m_frameLeverY, &m_frameLeverZ, &m_frameWeight, &m_frameSigma,
+		&m_x, &m_y, &m_z, &m_outX, &m_outY, &m_outZ, &m_median })
+		array->resize(count);
+	m_rotation.resize(9 * count);
+	m_frameRotation.resize(9 * count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Quat& q = mounts[i].rotation;
+		double* r = &m_rotation[9 * i];
+		r[0] = 1.0 - 2.0 * (q.y * q.y + q.z * q.z);
+		r[1] = 2.0 * (q.x * q.y - q.w * q.z);
+		r[2] = 2.0 * (q.x * q.z + q.w * q.y);
+		r[3] = 2.0 * (q.x * q.y + q.w * q.z);
+		r[4] = 1.0 - 2.0 * (q.x * q.x + q.z * q.z);
+		r[5] = 2.0 * (q.y * q.z - q.w * q.x);
+		r[6] = 2.0 * (q.x * q.z - q.w * q.y);
+		r[7] = 2.0 * (q.y * q.z + q.w * q.x);
+		r[8] = 1.0 - 2.0 * (q.x * q.x + q.y * q.y);
+
+		m_leverX[i] = mounts[i].leverArm.x;
+		m_leverY[i] = mounts[i].leverArm.y;
+		m_leverZ[i] = mounts[i].leverArm.z;
+		m_gyroWeight[i] = combineNoise(0.0, m_noise[i].gyroNoise);
+		m_accelerationWeight[i] = combineNoise(0.0, m_noise[i].accelerationNoise);
+	}
+}
+
+/*! \brief Combine the increments of one resampled frame into one virtual IMU sample
+	\param frame The aligned increments of the devices, in their own frames
+	\param dt The period of the frame in seconds
+	\param sample Receives the fused increments in the rig frame, invalid when no device delivered data
+	\returns True if the sample is valid
+*/
+bool VirtualImu::fuse(const ResampledFrame& frame, double dt, VirtualImuSample& sample)
+{
+	sample = VirtualImuSample();
+	double sqrtDt = sqrt(max(dt, 0.0));
+
+	// Gather the devices with data into the front of the work arrays
+	size_t count = 0;
+	size_t devices = min(frame.valid.size(), deviceCount());
+	for (size_t d = 0; d < devices; ++d)
+	{
+		if (!frame.valid[d])
+			continue;
+		copy(&m_rotation[9 * d], &m_rotation[9 * d] + 9, &m_frameRotation[9 * count]);
+		m_frameLeverX[count] = m_leverX[d];
+		m_frameLeverY[count] = m_leverY[d];
+		m_frameLeverZ[count] = m_leverZ[d];
+		m_frameWeight[count] = m_gyroWeight[d];
+		m_frameSigma[count] = m_noise[d].gyroNoise * sqrtDt;
+
+		Vec3 angle = quatToRotationVector(frame.dq[d]);
+		m_x[count] = angle.x;
+		m_y[count] = angle.y;
+		m_z[count] = angle.z;
+		++count;
+	}
+	if (count == 0 || dt <= 0.0)
+	{
+		m_haveRate = false;
+		return false;
+	}
+
+	// The rotation of a rigid body is the same everywhere on it, only the device frames differ
+	Vec3 angle;
+	rotateBatch(m_frameRotation.data(), m_x.data(), m_y.data(), m_z.data(), m_outX.data(), m_outY.data(), m_outZ.data(), count);
+	robustMean(m_settings.minAngleGate, count, angle, sample.rejectedAngles);
+
+	Vec3 rate = angle * (1.0 / dt);
+	Vec3 rateChange = m_haveRate ? rate - m_lastRate : Vec3();
+	m_lastRate = rate;
+	m_haveRate = true;
+
+	count = 0;
+	for (size_t d = 0; d < devices; ++d)
+	{
+		if (!frame.valid[d])
+			continue;
+		m_frameWeight[count] = m_accelerationWeight[d];
+		m_frameSigma[count] = m_noise[d].accelerationNoise * sqrtDt;
+		m_x[count] = frame.dv[d].x;
+		m_y[count] = frame.dv[d].y;
+		m_z[count] = frame.dv[d].z;
+		++count;
+	}
+	rotateBatch(m_frameRotation.data(), m_x.data(), m_y.data(), m_z.data(), m_outX.data(), m_outY.data(), m_outZ.data(), count);
+
+	// A device at lever arm r also senses the tangential (dw x r) and centripetal (w x (w x r)) acceleration
+	for (size_t i = 0; i < count; ++i)
+	{
+		Vec3 lever = { m_frameLeverX[i], m_frameLeverY[i], m_frameLeverZ[i] };
+		Vec3 correction = cross(rateChange, lever) + cross(rate, cross(rate, lever)) * dt;
+		m_outX[i] -= correction.x;
+		m_outY[i] -= correction.y;
+		m_outZ[i] -= correction.z;
+	}
+
+	Vec3 velocity;
+	robustMean(m_settings.minVelocityGate, count, velocity, sample.rejectedVelocities);
+
+	sample.valid = true;
+	sample.dq = quatFromRotationVector(angle);
+	sample.dv = velocity;
+	sample.devices = count;
+	return true;
+}
+
+/*! \brief Forget the previous rotation rate, after a gap in the data */
+void VirtualImu::reset()
+{
+	m_haveRate = false;
+	m_lastRate = Vec3();
+}
+
+/*! \returns The number of devices of the rig */
+size_t VirtualImu::deviceCount() const
+{
+	return m_noise.size();
+}
+
+/*! \returns The noise of the virtual IMU when all devices contribute, for the filter that integrates it
+	\details The noise densities of an inverse-variance weighted average combine like parallel
+	resistors. The initial uncertainties are taken from the first device.
+*/
+FilterNoise VirtualImu::fusedNoise() const
+{
+	FilterNoise fused = m_noise.empty() ? FilterNoise() : m_noise.front();
+	if (m_noise.empty())
+		return fused;
+
+	double gyro = 0.0, acceleration = 0.0, gyroBias = 0.0, accelerationBias = 0.0;
+	for (auto const& noise : m_noise)
+	{
+		gyro = combineNoise(gyro, noise.gyroNoise);
+		acceleration = combineNoise(acceleration, noise.accelerationNoise);
+		gyroBias = combineNoise(gyroBias, noise.gyroBiasRandomWalk);
+		accelerationBias = combineNoise(accelerationBias, noise.accelerationBiasRandomWalk);
+	}
+	fused.gyroNoise = 1.0 / sqrt(gyro);
+	fused.accelerationNoise = 1.0 / sqrt(acceleration);
+	fused.gyroBiasRandomWalk = 1.0 / sqrt(gyroBias);
+	fused.accelerationBiasRandomWalk = 1.0 / sqrt(accelerationBias);
+	return fused;
+}
+
+/*! \brief Inverse-variance weighted mean of the rotated vectors, without the devices that disagree with the median
+	\details Uses the rotated vectors in m_outX/Y/Z and the weights and per-axis standard deviations
+	in m_frameWeight and m_frameSigma. When every device disagrees the median itself is used.
+	\param minGate The smallest rejection distance per axis
+	\param count The number of devices
+	\param mean Receives the mean
+	\param rejected Receives the number of rejected devices
+*/
+void VirtualImu::robustMean(double minGate, size_t count, Vec3& mean, size_t& rejected)
+{
+	Vec3 center;
+	copy(m_outX.begin(), m_outX.begin() + count, m_median.begin());
+	center.x = median(m_median.data(), count);
+	copy(m_outY.begin(), m_outY.begin() + count, m_median.begin());
+	center.y = median(m_median.data(), count);
+	copy(m_outZ.begin(), m_outZ.begin() + count, m_median.begin());
+	center.z = median(m_median.data(), count);
+
+	Vec3 sum;
+	double weights = 0.0;
+	rejected = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		double gate = max(m_settings.outlierSigma * m_frameSigma[i], minGate);
+		double distance = max({ fabs(m_outX[i] - center.x), fabs(m_outY[i] - center.y), fabs(m_outZ[i] - center.z) });
+		if (distance > gate)
+		{
+			++rejected;
+			continue;
+		}
+		sum = sum + Vec3 { m_outX[i], m_outY[i], m_outZ[i] } * m_frameWeight[i];
+		weights += m_frameWeight[i];
+	}
+	mean = weights > 0.0 ? sum * (1.0 / weights) : center;
+}
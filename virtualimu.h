@@ -0,0 +1,88 @@
+#ifndef VIRTUAL_IMU_H
+#define VIRTUAL_IMU_H
+
+#include "errorstatefilter.h"
+#include "imumath.h"
+#include "resampler.h"
+
+#include <string>
+#include <vector>
+
+/*	Virtual IMU of a rig: several devices mounted rigidly on one body, whose aligned dq/dv streams
+	are combined into the single stream of an IMU at the rig origin. The mounts are stored as a CSV
+	file with one row per device:
+	BluetoothAddress,RotationW,RotationX,RotationY,RotationZ,LeverArmX,LeverArmY,LeverArmZ
+*/
+
+/*! \brief How a device is mounted on the rig */
+struct SensorMount
+{
+	std::string bluetoothAddress;
+	Quat rotation;		//!< Rotates vectors from the device frame into the rig frame
+	Vec3 leverArm;		//!< Position of the device in the rig frame in m
+};
+
+/*! \brief Outlier rejection of the virtual IMU */
+struct VirtualImuSettings
+{
+	double outlierSigma = 4.0;			//!< Devices further than this many standard deviations from the median are rejected
+	double minAngleGate = 2e-3;			//!< Lower bound of the rejection distance for dq in rad, covers mounting errors
+	double minVelocityGate = 2e-2;		//!< Lower bound of the rejection distance for dv in m/s
+};
+
+/*! \brief One fused sample of the virtual IMU, in the rig frame */
+struct VirtualImuSample
+{
+	bool valid = false;
+	Quat dq;
+	Vec3 dv;
+	size_t devices = 0;				//!< The number of devices that contributed
+	size_t rejectedAngles = 0;		//!< The number of devices whose dq was rejected as an outlier
+	size_t rejectedVelocities = 0;	//!< The number of devices whose dv was rejected as an outlier
+};
+
+bool loadSensorMounts(const std::string& fileName, std::vector<SensorMount>& mounts);
+
+void rotateBatch(const double* rotation, const double* x, const double* y, const double* z,
+	double* outX, double* outY, double* outZ, size_t count);
+
+/*! \brief Fuses the resampled streams of the devices of a rig into one virtual IMU
+	\details Each frame the increments of the devices are rotated into the rig frame, devices that
+	disagree with the median are rejected, and the rest is averaged with inverse-variance weights
+	from the device noise. The velocity increments are first moved to the rig origin, removing the
+	centripetal and tangential terms of their lever arms. Device i of the resampled frames is mount i.
+*/
+class VirtualImu
+{
+public:
+	VirtualImu(const std::vector<SensorMount>& mounts, const std::vector<FilterNoise>& noise,
+		const VirtualImuSettings& settings = VirtualImuSettings());
+
+	bool fuse(const ResampledFrame& frame, double dt, VirtualImuSample& sample);
+	void reset();
+
+	size_t deviceCount() const;
+	FilterNoise fusedNoise() const;
+
+private:
+	void robustMean(double minGate, size_t count, Vec3& mean, size_t& rejected);
+
+	std::vector<double> m_rotation;			//!< Row-major rotation matrix per device, 9 values each
+	std::vector<double> m_leverX, m_leverY, m_leverZ;
+	std::vector<double> m_gyroWeight, m_accelerationWeight;	//!< Inverse-variance weight per device
+	std::vector<FilterNoise> m_noise;
+	VirtualImuSettings m_settings;
+
+	bool m_haveRate = false;
+	Vec3 m_lastRate;
+
+	// Per-frame work arrays, compacted to the devices that delivered data
+	std::vector<double> m_frameRotation;
+	std::vector<double> m_frameLeverX, m_frameLeverY, m_frameLeverZ;
+	std::vector<double> m_frameWeight, m_frameSigma;
+	std::vector<double> m_x, m_y, m_z;
+	std::vector<double> m_outX, m_outY, m_outZ;
+	std::vector<double> m_median;
+};
+
+#endif
@@ -31,6 +31,7 @@
 
 #include "user_settings.h"
 #include "conio.h"
+#include "tracing.h"
 
 #include <iostream>
 #include <iomanip>
@@ -57,6 +58,7 @@ XdpcHandler::~XdpcHandler() noexcept
 */
 bool XdpcHandler::initialize()
 {
+	TRACE_SPAN("XdpcHandler::initialize");
 	// Print SDK version
 	XsVersion version;
 	xsdotsdkDllVersion(&version);
@@ -80,6 +82,7 @@ bool XdpcHandler::initialize()
 /*! \brief Close connections to any Movella DOT devices and destructs the connection manager created in initialize */
 void XdpcHandler::cleanup()
 {
+	TRACE_SPAN("XdpcHandler::cleanup");
 	if (!m_manager)
 		return;
 
@@ -101,6 +104,7 @@ void XdpcHandler::cleanup()
 */
 void XdpcHandler::scanForDots()
 {
+	TRACE_SPAN("XdpcHandler::scanForDots");
 	// Optionally, on Linux you can use another available bluetooth adapter using the name
 	// Note that this adapter needs to be changed prior to enabling Device Detection, uncomment the lines below
 	// cout << "Setting bluetooth adapter to use" << endl;
@@ -149,6 +153,7 @@ void XdpcHandler::scanForDots()
 */
 void XdpcHandler::connectDots()
 {
+	TRACE_SPAN("XdpcHandler::connectDots");
 	for (auto& portInfo : detectedDots())
 	{
 		if (portInfo.isBluetooth())
@@ -285,21 +290,147 @@ int XdpcHandler::packetsReceived() const
 	return m_packetsReceived;
 }
 
+/*! \returns The number of live data packets discarded because a device's packet buffer was full */
+size_t XdpcHandler::packetsDropped() const
+{
+	xsens::Lock locky(&m_mutex);
+	return m_packetsDropped;
+}
+
 /*! \returns The next available data packet for the Movella DOT with the provided bluetoothAddress
 	\param bluetoothAddress The bluetooth address of the Movella DOT to get the next packet for
 */
 XsDataPacket XdpcHandler::getNextPacket(const XsString& bluetoothAddress)
 {
-	if (!packetAvailable(bluetoothAddress))
-		return XsDataPacket();
+	TRACE_SPAN("XdpcHandler::getNextPacket");
+	TRACE_SPAN_BEGIN(lockWait, "XdpcHandler::mutexWait");
 	xsens::Lock locky(&m_mutex);
-	XsDataPacket oldestPacket(m_packetBuffer[bluetoothAddress].front());
-	m_packetBuffer[bluetoothAddress].pop_front();
+	TRACE_SPAN_END(lockWait);
+	auto buffer = m_packetBuffer.find(bluetoothAddress);
+	if (buffer == m_packetBuffer.end() || buffer->second.empty())
+		return XsDataPacket();
+
+	XsDataPacket oldestPacket(buffer->second.front());
+	buffer->second.pop_front();
 	--m_numberOfPacketsInBuffer[bluetoothAddress];
 
 	return oldestPacket;
 }
 
+/*! \brief Take all buffered packets of all devices at once
+	\details The packet lists are moved out under a single lock acquisition, the fields are copied
+	into the batch afterwards, so the callback thread is held up for as short as possible
+	\param batch Receives the samples, its previous contents are replaced
+	\returns The total number of drained samples
+*/
+size_t XdpcHandler::drainPackets(PacketBatch& batch)
+{
+	TRACE_SPAN("XdpcHandler::drainPackets");
+	batch.reset();
+
+	// The packets are moved out under the lock and copied and freed after it, the entries are reused
+	size_t drained = 0;
+	{
+		TRACE_SPAN_BEGIN(lockWait, "XdpcHandler::mutexWait");
+		xsens::Lock locky(&m_mutex);
+		TRACE_SPAN_END(lockWait);
+		for (auto& buffer : m_packetBuffer)
+		{
+			if (buffer.second.empty())
+				continue;
+			if (m_drained.size() <= drained)
+				m_drained.emplace_back();
+			m_drained[drained].first = buffer.first;
+			m_drained[drained].second.splice(m_drained[drained].second.end(), buffer.second);
+			m_numberOfPacketsInBuffer[buffer.first] = 0;
+			++drained;
+		}
+	}
+
+	for (size_t d = 0; d < drained; ++d)
+	{
+		batch.addDevice(m_drained[d].first, m_drained[d].second);
+		m_drained[d].second.clear();
+	}
+	return batch.samples();
+}
+
+/*! \brief Empty the batch, keeping the memory of its arrays */
+void PacketBatch::reset()
+{
+	m_devices = 0;
+	m_samples = 0;
+}
+
+/*! \brief Allocate and touch the arrays up front, so draining up to this size never allocates
+	\param devices The number of devices
+	\param samples The total number of samples
+*/
+void PacketBatch::reserve(size_t devices, size_t samples)
+{
+	if (bluetoothAddress.size() < devices)
+	{
+		bluetoothAddress.resize(devices);
+		deviceFirst.resize(devices);
+		deviceCount.resize(devices);
+	}
+	if (valid.size() < samples)
+	{
+		for (auto array : { &dqW, &dqX, &dqY, &dqZ, &dvX, &dvY, &dvZ })
+			array->resize(samples);
+		valid.resize(samples);
+		sampleTimeFine.resize(samples);
+	}
+}
+
+/*! \brief Append the samples of one device
+	\param address The bluetooth address of the device
+	\param packets The packets of the device, oldest first
+*/
+void PacketBatch::addDevice(const XsString& address, const list<XsDataPacket>& packets)
+{
+	if (bluetoothAddress.size() <= m_devices)
+	{
+		bluetoothAddress.resize(m_devices + 1);
+		deviceFirst.resize(m_devices + 1);
+		deviceCount.resize(m_devices + 1);
+	}
+	bluetoothAddress[m_devices] = address;
+	deviceFirst[m_devices] = m_samples;
+	deviceCount[m_devices] = packets.size();
+	++m_devices;
+
+	size_t end = m_samples + packets.size();
+	if (valid.size() < end)
+	{
+		for (auto array : { &dqW, &dqX, &dqY, &dqZ, &dvX, &dvY, &dvZ })
+			array->resize(end);
+		valid.resize(end);
+		sampleTimeFine.resize(end);
+	}
+
+	size_t i = m_samples;
+	for (auto const& packet : packets)
+	{
+		valid[i] = packet.containsSampleTimeFine() && packet.containsOrientationIncrement() && packet.containsVelocityIncrement();
+		if (valid[i])
+		{
+			XsQuaternion q = packet.orientationIncrement();
+			XsVector v = packet.velocityIncrement();
+			sampleTimeFine[i] = packet.sampleTimeFine();
+			dqW[i] = q.w();
+			dqX[i] = q.x();
+			dqY[i] = q.y();
+			dqZ[i] = q.z();
+			dvX[i] = v.value(0);
+			dvY[i] = v.value(1);
+			dvZ[i] = v.value(2);
+		}
+		++i;
+	}
+	m_samples = end;
+}
+
 /*! \brief Initialize internal progress buffer for an Movella DOT device
 	\param bluetoothAddress The bluetooth address of the Movella DOT device
 */
@@ -370,13 +501,30 @@ void XdpcHandler::onError(XsResultValue result, const XsString* errorString)
 */
 void XdpcHandler::onLiveDataAvailable(XsDotDevice* device, const XsDataPacket* packet)
 {
-	xsens::Lock locky(&m_mutex);
+	TRACE_SPAN("XdpcHandler::onLiveDataAvailable");
 	assert(packet != nullptr);
-	while (m_numberOfPacketsInBuffer[device->bluetoothAddress()] >= m_maxNumberOfPacketsInBuffer)
-		(void)getNextPacket(device->bluetoothAddress());
+	bufferPacket(device->bluetoothAddress(), *packet);
+}
+
+/*! \brief Adds a packet to the packet buffer of a device
+	\details Removes the oldest packets if the buffer is full, these are counted as dropped
+	\param bluetoothAddress The bluetooth address of the device that sent the packet
+	\param packet The data packet to add
+*/
+void XdpcHandler::bufferPacket(const XsString& bluetoothAddress, const XsDataPacket& packet)
+{
+	TRACE_SPAN("XdpcHandler::bufferPacket");
+	TRACE_SPAN_BEGIN(lockWait, "XdpcHandler::mutexWait");
+	xsens::Lock locky(&m_mutex);
+	TRACE_SPAN_END(lockWait);
+	while (m_numberOfPacketsInBuffer[bluetoothAddress] >= m_maxNumberOfPacketsInBuffer)
+	{
+		(void)getNextPacket(bluetoothAddress);
+		++m_packetsDropped;
+	}
 
-	m_packetBuffer[device->bluetoothAddress()].push_back(*packet);
-	++m_numberOfPacketsInBuffer[device->bluetoothAddress()];
+	m_packetBuffer[bluetoothAddress].push_back(packet);
+	++m_numberOfPacketsInBuffer[bluetoothAddress];
 }
 
 /*! \brief Called when a long-duration operation has made some progress or has completed.
@@ -426,6 +574,7 @@ void XdpcHandler::onRecordingStopped(XsDotDevice* device)
 */
 void XdpcHandler::onDeviceStateChanged(XsDotDevice* device, XsDeviceState newState, XsDeviceState oldState)
 {
+	TRACE_SPAN("XdpcHandler::onDeviceStateChanged");
 	(void)oldState;
 	if (newState == XDS_Destructing && !m_closing)
 	{
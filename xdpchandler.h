@@ -33,6 +33,37 @@
 #include <movelladot_pc_sdk.h>
 #include <xscommon/xsens_mutex.h>
 #include <list>
+#include <vector>
+
+/*! \brief Buffered live data of all devices, drained in one go by XdpcHandler::drainPackets
+	\details Every field is a contiguous array over all drained samples. The samples of device d are
+	at [deviceFirst[d], deviceFirst[d] + deviceCount[d]), oldest first. Reuse one batch for every
+	drain, the arrays only grow so a steady stream of packets does not allocate.
+*/
+struct PacketBatch
+{
+	std::vector<XsString> bluetoothAddress;	//!< Per device
+	std::vector<size_t> deviceFirst;		//!< Per device, index of its first sample
+	std::vector<size_t> deviceCount;		//!< Per device, number of samples
+
+	std::vector<uint8_t> valid;				//!< Per sample, 1 if the packet has SampleTimeFine, dq and dv
+	std::vector<uint32_t> sampleTimeFine;
+	std::vector<double> dqW, dqX, dqY, dqZ;
+	std::vector<double> dvX, dvY, dvZ;
+
+	size_t devices() const { return m_devices; }
+	size_t samples() const { return m_samples; }
+	void reserve(size_t devices, size_t samples);
+
+private:
+	friend class XdpcHandler;
+
+	void reset();
+	void addDevice(const XsString& address, const std::list<XsDataPacket>& packets);
+
+	size_t m_devices = 0;
+	size_t m_samples = 0;
+};
 
 class XdpcHandler : public XsDotCallback
 {
@@ -60,7 +91,9 @@ public:
 	bool packetsAvailable() const;
 	bool packetAvailable(const XsString& bluetoothAddress) const;
 	XsDataPacket getNextPacket(const XsString& bluetoothAddress);
+	size_t drainPackets(PacketBatch& batch);
 	int packetsReceived() const;
+	size_t packetsDropped() const;
 	void addDeviceToProgressBuffer(XsString bluetoothAddress);
 	int progress(XsString bluetoothAddress);
 
@@ -81,7 +114,10 @@ protected:
 	void onRecordedDataDone(XsDotDevice* device) override;
 
 private:
+	friend class LoadGenerator;
+
 	void outputDeviceProgress() const;
+	void bufferPacket(const XsString& bluetoothAddress, const XsDataPacket& packet);
 
 	XsDotConnectionManager* m_manager = nullptr;
 
@@ -94,6 +130,7 @@ private:
 	int m_progressCurrent = 0;
 	int m_progressTotal = 0;
 	int m_packetsReceived = 0;
+	size_t m_packetsDropped = 0;
 	XsPortInfoArray m_detectedDots;
 	std::list<XsDotDevice*> m_connectedDots;
 	std::list<XsDotUsbDevice*> m_connectedUsbDots;
@@ -101,6 +138,7 @@ private:
 	size_t m_maxNumberOfPacketsInBuffer;
 	std::map<XsString, size_t> m_numberOfPacketsInBuffer;
 	std::map<XsString, std::list<XsDataPacket>> m_packetBuffer;
+	std::vector<std::pair<XsString, std::list<XsDataPacket>>> m_drained;	//!< Reused by drainPackets, only touched by the draining thread
 	std::map<XsString, int> m_progressBuffer;
 };
 